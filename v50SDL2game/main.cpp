@@ -2,16 +2,132 @@
 #include <SDL.h>
 #include <SDL_image.h>
 #include <SDL_ttf.h>
+#include <SDL_mixer.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string>
 #include <cmath>
 #include <vector>
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <type_traits>
+
+//SSE2 is always there on x64, and on x86 when the compiler targets it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HAVE_SSE2 1
+#endif
 //The dimensions of the level
 const int LEVEL_WIDTH = 1280;
 const int LEVEL_HEIGHT = 960;
+
 //Screen dimension constants
 const int SCREEN_WIDTH = 850;
 const int SCREEN_HEIGHT = 960;
+//Colour themes for the level art, only the bright set is loaded from disk
+enum Theme
+{
+	THEME_BRIGHT,
+	THEME_PALE,
+	THEME_TOTAL
+};
+
+//How a theme is derived from the bright art
+struct PaletteVariant
+{
+	const char* name;
+	int saturation;		//256 keeps full colour, 0 is greyscale
+	int lift;			//raises the darkest value towards white
+};
+
+class LTexture;
+
+//Tracks texture memory and pool usage, shown as an overlay and dumped as JSON lines
+class Telemetry
+{
+public:
+	//Lines in the on-screen overlay
+	static const int OVERLAY_LINES = 8;
+
+	//How often the overlay text is rebuilt, in ms
+	static const Uint32 OVERLAY_INTERVAL = 500;
+
+	//How often a dump line is written, in ms
+	static const Uint32 DUMP_INTERVAL = 5000;
+
+	//Initializes variables
+	Telemetry();
+
+	//Texture lifetime, reported by LTexture
+	void onTextureObject(int delta);
+	void onTextureCreated(const std::string& asset, long long bytes);
+	void onTextureDestroyed(const std::string& asset, long long bytes);
+
+	//Sets a named usage figure, peaks are kept automatically
+	void setGauge(const std::string& name, long long value);
+
+	//Starts appending a dump line every DUMP_INTERVAL to a file
+	bool openDump(std::string path);
+
+	//Writes dumps when due, call once per frame
+	void update();
+
+	//Shows or hides the overlay
+	void toggleOverlay() { mOverlayVisible = !mOverlayVisible; mOverlayTime = 0; }
+
+	//Draws the overlay in the top right corner
+	void renderOverlay();
+
+	//Frees the overlay textures
+	void free();
+
+private:
+	struct AssetStats
+	{
+		int count;
+		long long bytes;
+		long long peakBytes;
+	};
+
+	struct Gauge
+	{
+		long long value;
+		long long peak;
+	};
+
+	//Writes one JSON line with everything tracked
+	void writeDump();
+
+	int mTextureObjects;
+	int mLiveTextures;
+	long long mTextureBytes;
+	long long mPeakTextureBytes;
+	long long mTexturesCreated;
+	long long mTexturesDestroyed;
+
+	//Creations since the last overlay refresh, shows texture churn
+	long long mCreatedAtLastRefresh;
+	double mCreatedPerSecond;
+
+	std::map<std::string, AssetStats> mAssets;
+	std::map<std::string, Gauge> mGauges;
+
+	std::ofstream mDump;
+	Uint32 mDumpTime;
+
+	bool mOverlayVisible;
+	Uint32 mOverlayTime;
+	LTexture* mOverlay[OVERLAY_LINES];
+
+	//Text each overlay texture was made from, unchanged lines keep their texture
+	std::string mOverlayText[OVERLAY_LINES];
+};
+
+Telemetry gTelemetry;
+
 //Texture wrapper class
 class LTexture
 {
@@ -25,6 +141,9 @@ public:
 	//Loads image at specified path
 	bool loadFromFile(std::string path);
 
+	//Uploads a surface that is already in memory, the caller keeps the surface
+	bool loadFromSurface(SDL_Surface* surface, const std::string& asset);
+
 	bool loadFromRenderedText(std::string textureText, SDL_Color textcolor);
 
 	//Deallocates texture
@@ -46,122 +165,453 @@ public:
 	int getWidth();
 	int getHeight();
 
+	//Gets texture memory in bytes
+	long long getBytes() const { return mBytes; }
+
 private:
+	//Reports a newly created texture to telemetry
+	void track(const std::string& asset);
+
 	//The actual hardware texture
 	SDL_Texture* mTexture;
 
+	//What was loaded and how big it is, for telemetry
+	std::string mAsset;
+	long long mBytes;
+
 	//Image dimensions
 	int mWidth;
 	int mHeight;
 };
 
-//The dot that will move around on the screen
-class Dot
+//Single-producer single-consumer ring buffer, lock-free
+//One slot is always left empty so full and empty can be told apart
+template <typename T, unsigned CAPACITY>
+class SPSCQueue
 {
 public:
-	//The dimensions of the dot
-	static const int DOT_WIDTH = 80;
-	static const int DOT_HEIGHT = 80;
+	SPSCQueue() : mHead(0), mTail(0) {}
 
-	//Maximum axis velocity of the dot
-	static const int DOT_VEL = 10;
+	//Producer side, returns false instead of waiting when the queue is full
+	bool push(const T& item)
+	{
+		unsigned tail = mTail.load(std::memory_order_relaxed);
+		unsigned next = (tail + 1) % CAPACITY;
+		if (next == mHead.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		mItems[tail] = item;
+		mTail.store(next, std::memory_order_release);
+		return true;
+	}
 
-	//Initializes the variables
-	Dot();
+	//Consumer side, returns false when there is nothing to read
+	bool pop(T& item)
+	{
+		unsigned head = mHead.load(std::memory_order_relaxed);
+		if (head == mTail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		item = mItems[head];
+		mHead.store((head + 1) % CAPACITY, std::memory_order_release);
+		return true;
+	}
 
-	//Takes key presses and adjusts the dot's velocity
-	void handleEvent(SDL_Event& e);
+private:
+	T mItems[CAPACITY];
 
-	//Moves the dot
-	void move(SDL_Rect enemyCollider);
+	//Kept on separate cache lines so the two threads don't fight over them
+	alignas(64) std::atomic<unsigned> mHead;
+	alignas(64) std::atomic<unsigned> mTail;
+};
 
-	//Shows the dot on the screen relative to the camera
-	void render(int camX, int camY);
+//Sound effects the game can trigger
+//Listed from least to most important, when the channels run out a sound only steals a voice from one listed no later than itself
+enum SoundId
+{
+	SOUND_SHOT,
+	SOUND_HIT,
+	SOUND_ENEMY_DEAD,
+	SOUND_TOTAL
+};
 
-	//Position accessors
-	int getPosX();
-	int getPosY();
+//Audio on SDL2_mixer, fed from the game thread through a lock-free queue
+class AudioEngine
+{
+public:
+	//Size of the channel pool, extra sounds steal a voice
+	static const int AUDIO_CHANNELS = 16;
 
-	//movement
-	enum DotState { IDLE, WALKING };
+	//Number of play commands that can be waiting at once
+	static const unsigned AUDIO_QUEUE_SIZE = 256;
 
-	DotState mState;
+	//Initializes variables
+	AudioEngine();
 
-	SDL_Rect getCollider()
+	//Opens the audio device, preloads chunks and starts the audio thread
+	//Returns false when there is no audio, the game keeps running silently
+	bool init();
+
+	//Stops the audio thread and releases the device
+	void close();
+
+	//Queues a sound from the game thread, never waits on the audio device
+	void play(SoundId sound, int volume = 128);
+
+	//Queues a stop of every playing channel
+	void stopAll();
+
+	bool isEnabled() const { return mEnabled; }
+
+	//Stats
+	int getDroppedCount() const { return mDropped.load(std::memory_order_relaxed); }
+	int getStolenCount() const { return mStolen.load(std::memory_order_relaxed); }
+
+private:
+	enum CommandType { CMD_PLAY, CMD_STOP_ALL };
+
+	struct AudioCommand
 	{
-		SDL_Rect collider = { mPosX, mPosY, DOT_WIDTH, DOT_HEIGHT };
-		return collider;
-	}
+		CommandType type;
+		SoundId sound;
+		int volume;
+	};
+
+	//Loads a chunk from disk, or builds a placeholder if the file is missing
+	Mix_Chunk* loadChunk(SoundId sound, const char* path);
+
+	//Runs a command on the audio thread
+	void execute(const AudioCommand& cmd);
+
+	//Finds a free channel or steals one, -1 if nothing may be stolen
+	int pickChannel(SoundId sound);
+
+	static int audioThread(void* data);
+
+	bool mOpened;
+	bool mEnabled;
+	std::atomic<bool> mRunning;
+	SDL_Thread* mThread;
+
+	SPSCQueue<AudioCommand, AUDIO_QUEUE_SIZE> mQueue;
+
+	//Posted for every queued command so the audio thread can sleep until there is work
+	SDL_sem* mSignal;
+
+	Mix_Chunk* mChunks[SOUND_TOTAL];
+
+	//Samples for placeholder chunks, mixer only points into these
+	std::vector<Sint16> mSynthBuffers[SOUND_TOTAL];
 
+	//Voice bookkeeping, only touched by the audio thread
+	SoundId mChannelSound[AUDIO_CHANNELS];
+	Uint32 mChannelStart[AUDIO_CHANNELS];
 
+	std::atomic<int> mDropped;
+	std::atomic<int> mStolen;
+};
+
+AudioEngine gAudio;
+
+//Kinds of particle effect, each one is drawn in its own batch
+enum EmitterId
+{
+	EMITTER_MUZZLE,
+	EMITTER_HIT,
+	EMITTER_TOTAL
+};
+
+//How an emitter spawns its particles
+struct ParticleEmitter
+{
+	SDL_Color color;
+	float size;
+	int burst;
+	float minSpeed, maxSpeed;
+	float spread;		//radians either side of the emit direction
+	float life;			//in frames
+	float gravity;		//added to y velocity each frame
+};
+
+//Particle effects stored as structure-of-arrays and updated four at a time
+class ParticleSystem
+{
+public:
+	//Room for 100k live particles with some slack, multiple of 4 for SIMD
+	static const int MAX_PARTICLES = 131072;
+
+	//Velocity kept each frame
+	static constexpr float PARTICLE_DRAG = 0.92f;
+
+	//Initializes variables, nothing is allocated until init
+	ParticleSystem();
+
+	//Allocates the arrays and the vertex batch, only the game calls this so headless runs never pay for it
+	void init();
+
+	//Spawns a burst at a point, dirX is 1 for right and -1 for left
+	void emit(EmitterId emitter, float x, float y, float dirX);
+
+	//Advances every particle by one frame and recycles the dead ones
+	void update();
+
+	//Draws each emitter's particles with one geometry call
+	void render(int camX, int camY);
+
+	//Keeps bursts going across the view until this many particles are alive, 0 turns it off
+	void setStressTarget(int liveParticles);
+
+	//Tops the live count up to the stress target
+	void emitStress(const SDL_Rect& view);
+
+	//Removes every particle
+	void clear();
+
+	int getLiveCount() const { return mLiveCount; }
 
 private:
-	int mHealth;
+	//Takes a slot off the free list, -1 when full
+	int allocate();
+
+	//Random float in [0, 1)
+	float random();
+
+	//Particle data, one array per field
+	std::vector<float> mPosX, mPosY;
+	std::vector<float> mVelX, mVelY;
+	std::vector<float> mAccY;
+	std::vector<float> mLife;
+	std::vector<float> mInvMaxLife;
+	std::vector<Uint8> mEmitter;
+	std::vector<Uint8> mAlive;
+
+	//Recycled slots
+	std::vector<int> mFreeList;
+
+	//Slots past this have never been used, kept a multiple of 4
+	int mHighWater;
+	int mLiveCount;
+
+	Uint32 mSeed;
+	int mStressTarget;
+
+	//One vertex batch sized for every particle, each emitter gets its own range of it,
+	//and the shared quad index pattern
+	std::vector<SDL_Vertex> mVertices;
+	std::vector<int> mIndices;
+};
 
-	//The X and Y offsets of the dot
-	int mPosX, mPosY;
+ParticleSystem gParticles;
 
-	//The velocity of the dot
-	int mVelX, mVelY;
+class WaveSpawner;
 
-	Uint32 lastDamageTime;
+//Animations, each one a clip of frames from a sprite sheet
+enum AnimClip
+{
+	CLIP_IDLE,
+	CLIP_RUN,
+	CLIP_SHOT,
+	CLIP_HURT,
+	CLIP_DEAD,
+	CLIP_ENEMY_IDLE,
+	CLIP_ENEMY_HURT,
+	CLIP_ENEMY_DEAD,
+	CLIP_TOTAL
+};
+
+//Per-entity animation state, small enough to copy around with the entity
+struct AnimState
+{
+	Uint8 clip;
+	Uint8 finished;		//set when a clip with nowhere to go has played out
+	Uint16 time;		//simulation frames into the clip
+};
 
+//Opaque pixels of one sprite frame, one bit each, for pixel-accurate hits
+//Rows are two 64-bit words wide, bit n of a row is pixel n from the left
+class CollisionMask
+{
 public:
-	int getHealth() const { return mHealth; }  // Getter for health
-	void reduceHealth(int amount) { mHealth -= amount; }
-	void resetHealth() { mHealth = 100; }
+	//Widest frame a mask can cover
+	static const int MAX_WIDTH = 128;
+
+	//Alpha a pixel needs to count as solid
+	static const Uint8 ALPHA_THRESHOLD = 128;
+
+	//Initializes variables
+	CollisionMask();
+
+	//Builds a width x height mask from an area of a 32-bit ARGB surface stretched to fit,
+	//the way SDL_RenderCopy draws a clip, mirrored for sprites drawn flipped
+	void build(SDL_Surface* surface, const SDL_Rect& source, int width, int height, bool mirrored);
+
+	//Box around the solid pixels, relative to the frame's top left corner
+	const SDL_Rect& getBounds() const { return mBounds; }
+
+	bool isEmpty() const { return mBounds.w == 0; }
+
+	//Does this mask drawn at (x, y) share a solid pixel with other drawn at (otherX, otherY)?
+	bool overlaps(int x, int y, const CollisionMask& other, int otherX, int otherY) const;
+
+	//Does this mask drawn at (x, y) have a solid pixel inside the box?
+	bool overlapsRect(int x, int y, SDL_Rect box) const;
+
+private:
+	static const int ROW_WORDS = MAX_WIDTH / 64;
+
+	int mHeight;
+	SDL_Rect mBounds;
+
+	//ROW_WORDS per row, packed
+	std::vector<Uint64> mRows;
 };
 
-class Enemy
+//Something that can be hit: a box, and the mask drawn at (x, y) when it has one
+//Without a mask the whole box is solid
+struct CollisionShape
+{
+	SDL_Rect box;
+	const CollisionMask* mask;
+	int x, y;
+};
+
+//Clip definitions with their frame timelines worked out ahead of time
+class AnimationSet
 {
 public:
-	static const int ENEMY_WIDTH = 20;
-	static const int ENEMY_HEIGHT = 20;
+	//Simulation frames each animation frame is shown for, 100 ms at 60 FPS
+	static const int TICKS_PER_FRAME = 6;
 
-	static const int ENEMY_VEL = 2;
-	static const int ENEMY_MAX_HEALTH = 50;
+	//Defines a clip from hand-placed frames
+	//A clip that doesn't loop moves on to next when it ends, or holds its last frame if next is itself
+	void defineClip(AnimClip clip, const SDL_Rect* frames, int frameCount, bool loop, AnimClip next);
 
-	Enemy(int x, int y);
+	//Defines a clip from a sheet of equal cells laid out left to right, the cells are placed by loadSheet
+	void defineGridClip(AnimClip clip, int cellWidth, bool loop, AnimClip next);
 
-	void move();
+	//Sets the texture a clip is drawn from, headless runs never set one
+	void setSheet(AnimClip clip, LTexture* sheet) { mClips[clip].sheet = sheet; }
 
-	void render(int camX, int camY);
+	//Starts a clip, time lets entities start at different points of a loop
+	void start(AnimState& state, AnimClip clip, int time = 0);
 
+	//Switches to a clip for a gameplay event, a loop already playing is left alone
+	void play(AnimState& state, AnimClip clip);
 
-	void takeDamage(int amount) {
-		health -= amount;
-		if (health <= 0) {
-			health = 0;
-			// Handle enemy death logic (e.g., remove from vector)
-		}
-	}
+	//Moves one entity's animation on by a frame
+	void advance(AnimState& state);
 
-	bool isDead() {
-		return health <= 0;
-	}
+	//Shows the current frame
+	void render(const AnimState& state, int x, int y, SDL_RendererFlip flip = SDL_FLIP_NONE);
 
-	SDL_Rect getCollider()
+	//Reads a clip's sheet image without a renderer, lays out grid cells and builds
+	//collision masks for every frame from its alpha
+	bool loadSheet(AnimClip clip, const std::string& path);
+
+	//Mask of the current frame, NULL when the clip has none
+	const CollisionMask* getMask(const AnimState& state, SDL_RendererFlip flip = SDL_FLIP_NONE) const;
+
+	//Gives the clips in the range one box around every mask they have, either way round
+	//An entity's collider then doesn't move when its frame or facing changes
+	void shareBounds(AnimClip first, AnimClip last);
+
+	//Collider box for the clip relative to where it is drawn, NULL when the clip has no masks
+	const SDL_Rect* getBounds(const AnimState& state) const;
+
+	bool isLooping(const AnimState& state) const { return mClips[state.clip].loop; }
+	bool isFinished(const AnimState& state) const { return state.finished != 0; }
+
+private:
+	struct Clip
 	{
-		if (!isDead())
-		{
-			SDL_Rect collider = { mPosX, mPosY + 70, ENEMY_WIDTH, ENEMY_HEIGHT };
-			return collider;
-		}
-		return{ 0,0,0,0 };
-	}
+		LTexture* sheet;
+		std::vector<SDL_Rect> frames;
 
-	
+		//Frame to show on each simulation frame of the clip
+		std::vector<Uint8> timeline;
 
-	int health;
+		//Two per frame, as drawn and mirrored
+		std::vector<CollisionMask> masks;
+
+		//Box around the masks, shared across the entity's clips
+		SDL_Rect bounds;
+
+		//Cell width of a grid clip, 0 for hand-placed frames
+		int cellWidth;
+
+		bool loop;
+		AnimClip next;
+	};
+
+	//Sets a clip's frames and works out its timeline
+	static void setFrames(Clip& c, const SDL_Rect* frames, int frameCount);
+
+	Clip mClips[CLIP_TOTAL];
+};
+
+AnimationSet gAnimations;
+
+//Appends raw bytes to a snapshot buffer, the buffer keeps its capacity between frames
+inline void snapshotWrite(std::vector<Uint8>& out, const void* data, size_t size)
+{
+	size_t offset = out.size();
+	out.resize(offset + size);
+	memcpy(out.data() + offset, data, size);
+}
+
+//Reads raw bytes back out of a snapshot and advances past them
+inline void snapshotRead(const Uint8*& in, void* data, size_t size)
+{
+	memcpy(data, in, size);
+	in += size;
+}
+
+//Shares themed textures so each path and theme is only loaded once
+//Variants are derived from the bright image, which is freed as soon as the texture is up
+class ThemeCache
+{
+public:
+	ThemeCache();
+
+	//Deallocates every cached texture
+	~ThemeCache();
+
+	//Gets the texture for a bright asset path in a theme, loading it on first use
+	LTexture* get(const std::string& path, Theme theme);
+
+	//Frees textures of every theme but the one last asked for
+	void trim();
 
+	//Deallocates every cached texture
+	void free();
+
+	//Prints resident and freed texture memory, and how often a texture was shared
+	void printReport();
 
 private:
+	struct Entry
+	{
+		std::string path;
+		Theme theme;
+		LTexture* texture;
+	};
 
-	int mPosX, mPosY;
+	std::vector<Entry> mEntries;
 
-	int mVelX, mVelY;
+	//The only theme trim keeps
+	Theme mCurrent;
+
+	//Counted as it happens
+	int mDecodes;
+	int mHits;
+	int mEvicted;
+	long long mEvictedBytes;
 };
 
+ThemeCache gThemes;
+
 //The window we'll be rendering to
 SDL_Window* gWindow = NULL;
 
@@ -204,412 +654,4875 @@ public:
 		SDL_RenderDrawRect(gRenderer, &colRect);
 	}
 
-	bool isOffScreen()
+	bool isOffScreen(int levelWidth)
 	{
-		return mPosX < 0 || mPosX > LEVEL_WIDTH;
+		return mPosX < 0 || mPosX > levelWidth;
 	}
 
 	SDL_Rect getCollider() {
 		return { mPosX, mPosY, PROJECTILE_WIDTH, PROJECTILE_HEIGHT };
 	}
 
+	int getDirection() const { return mDirection; }
+	int getVelX() const { return mVelX; }
+
 private:
 	int mPosX, mPosY;
 	int mVelX;
 	int mDirection;  // 1 = right, -1 = left
 };
 
-std::vector<Projectile> projectiles;
+//A particle burst asked for by the simulation, emitted when the frame is drawn
+struct EffectEvent
+{
+	EmitterId emitter;
+	float x, y;
+	float dirX;
+};
 
-//Starts up SDL and creates window
-bool init();
+//Per-instance state that everything in one simulation shares
+//Entities get it passed in, so several simulations can run side by side
+struct SimContext
+{
+	//Simulation frames since the game started, drives every gameplay timer
+	Uint32 frame;
 
-//Loads media
-bool loadMedia();
+	//Width of the level being played
+	int levelWidth;
 
-//Frees media and shuts down SDL
-void close();
+	std::vector<Projectile> projectiles;
 
+	//Effects and sounds raised this frame, played by whoever draws it
+	std::vector<EffectEvent> effects;
+	std::vector<SoundId> sounds;
+};
 
+//The dot that will move around on the screen
+class Dot
+{
+public:
+	//The dimensions of the dot
+	static const int DOT_WIDTH = 80;
+	static const int DOT_HEIGHT = 80;
 
-TTF_Font* gFont = NULL;
+	//Maximum axis velocity of the dot
+	static const int DOT_VEL = 10;
 
-LTexture gTextTexture;
+	//Frames between hits from touching an enemy, 3 seconds at 60 FPS
+	static const Uint32 DAMAGE_COOLDOWN_FRAMES = 180;
 
+	//Initializes the variables
+	Dot();
 
-//walking animation
-const int WALKING_ANIMATION_FRAMES = 10;
-SDL_Rect gSpriteClips[WALKING_ANIMATION_FRAMES];
-LTexture gWalkingSheetTexture;
+	//Takes key presses and adjusts the dot's velocity
+	void handleEvent(SDL_Event& e, SimContext& sim);
 
-//IDLE animation
-const int IDLE_ANIMATION_FRAMES = 6;
-SDL_Rect gIdleClips[IDLE_ANIMATION_FRAMES];
-LTexture gIdleSheetTexture;
+	//Replaces the held keys and rebuilds the velocity, used after a rewind
+	//since the restored frame remembers keys that may have been let go since
+	void syncInput(bool heldLeft, bool heldRight);
 
-//enemy animation
-const int ENEMY_ANIMATION_FRAMES = 6;
-SDL_Rect gEnemyclips[ENEMY_ANIMATION_FRAMES];
-LTexture gEnemyTexture;
-//Scene textures
-LTexture gDotTexture;
-LTexture gBGTexture;
+	//Moves the dot, stopping against any live enemy
+	void move(WaveSpawner& enemies, SimContext& sim);
 
+	//Shows the dot on the screen relative to the camera
+	void render(int camX, int camY);
 
+	//Position accessors
+	int getPosX();
+	int getPosY();
 
-SDL_RendererFlip flipType = SDL_FLIP_NONE;
+	//movement
+	enum DotState { IDLE, WALKING };
 
-LTexture::LTexture()
-{
-	//Initialize
-	mTexture = NULL;
-	mWidth = 0;
-	mHeight = 0;
+	DotState mState;
+
+	//Box around every solid pixel the dot can show, the hand-placed box without masks
+	SDL_Rect getCollider()
+	{
+		const SDL_Rect* bounds = gAnimations.getBounds(mAnim);
+		if (bounds != NULL)
+		{
+			SDL_Rect collider = { mPosX + bounds->x, mPosY + bounds->y, bounds->w, bounds->h };
+			return collider;
+		}
+		SDL_Rect collider = { mPosX, mPosY, DOT_WIDTH, DOT_HEIGHT };
+		return collider;
+	}
+
+	//Pixel mask of the frame being shown, NULL if there isn't one
+	const CollisionMask* getMask() const { return gAnimations.getMask(mAnim, mFlipType); }
+
+	CollisionShape getShape()
+	{
+		CollisionShape shape = { getCollider(), getMask(), mPosX, mPosY };
+		return shape;
+	}
+
+
+
+private:
+	int mHealth;
+
+	//The X and Y offsets of the dot
+	int mPosX, mPosY;
+
+	//The velocity of the dot
+	int mVelX, mVelY;
+
+	//Arrow keys held down, the velocity follows from these
+	bool mHeldLeft, mHeldRight;
+
+	//Sets the velocity and movement state from the held keys
+	void updateVelocity();
+
+	//Simulation frame of the last hit taken
+	Uint32 lastDamageFrame;
+
+	//Which way the dot is facing
+	SDL_RendererFlip mFlipType;
+
+	AnimState mAnim;
+
+	//Moves the animation on, following the movement state between events
+	void updateAnimation();
+
+	//Takes a hit from touching an enemy, once per cooldown
+	void touchEnemy(SimContext& sim);
+
+public:
+	int getHealth() const { return mHealth; }  // Getter for health
+	void reduceHealth(int amount) { mHealth -= amount; }
+	void resetHealth() { mHealth = 100; }
+};
+
+class Enemy
+{
+public:
+	static const int ENEMY_WIDTH = 20;
+	static const int ENEMY_HEIGHT = 20;
+
+	static const int ENEMY_VEL = 2;
+	static const int ENEMY_MAX_HEALTH = 50;
+
+	Enemy(int x, int y);
+
+	//Puts a pooled enemy back into play at full health
+	void spawn(int x, int y);
+
+	void move();
+
+	void render(int camX, int camY);
+
+
+	void takeDamage(int amount, SimContext& sim) {
+		health -= amount;
+		if (health <= 0) {
+			health = 0;
+			sim.sounds.push_back(SOUND_ENEMY_DEAD);
+			// The spawner recycles the enemy once this has played out
+			gAnimations.play(mAnim, CLIP_ENEMY_DEAD);
+		}
+		else {
+			sim.sounds.push_back(SOUND_HIT);
+			gAnimations.play(mAnim, CLIP_ENEMY_HURT);
+		}
+	}
+
+	bool isDead() {
+		return health <= 0;
+	}
+
+	SDL_Rect getCollider()
+	{
+		if (!isDead())
+		{
+			//Same box for every frame, so changing frame can't push it into anything
+			const SDL_Rect* bounds = gAnimations.getBounds(mAnim);
+			if (bounds != NULL)
+			{
+				SDL_Rect collider = { mPosX + bounds->x, mPosY + bounds->y, bounds->w, bounds->h };
+				return collider;
+			}
+			SDL_Rect collider = { mPosX, mPosY + 70, ENEMY_WIDTH, ENEMY_HEIGHT };
+			return collider;
+		}
+		return{ 0,0,0,0 };
+	}
+
+	//Pixel mask of the frame being shown, NULL if there isn't one
+	const CollisionMask* getMask() const { return gAnimations.getMask(mAnim); }
+
+	CollisionShape getShape()
+	{
+		CollisionShape shape = { getCollider(), getMask(), mPosX, mPosY };
+		return shape;
+	}
+
+	AnimState& getAnimation() { return mAnim; }
+	
+
+	int health;
+
+
+private:
+
+	int mPosX, mPosY;
+
+	int mVelX, mVelY;
+
+	AnimState mAnim;
+};
+
+//Labels shown over enemies, one texture per health value made the first time it is needed
+class HealthLabels
+{
+public:
+	//Gets the label for a health value, NULL if it couldn't be rendered
+	LTexture* get(int health);
+
+	//Frees every label
+	void free();
+
+private:
+	LTexture mLabels[Enemy::ENEMY_MAX_HEALTH + 1];
+};
+
+HealthLabels gHealthLabels;
+
+//Level made of tile chunks that are streamed in and out around the camera
+class ChunkedLevel
+{
+public:
+	//Chunk buffers kept in memory, the screen plus a margin either side
+	static const int MAX_RESIDENT_CHUNKS = 8;
+
+	//Chunks kept beyond the ones in view before they are evicted
+	static const int CHUNK_MARGIN = 1;
+
+	//Tile id for an empty cell
+	static const Uint16 EMPTY_TILE = 0xFFFF;
+
+	//Initializes variables
+	ChunkedLevel();
+
+	//Stops the loader thread
+	~ChunkedLevel();
+
+	//Reads the level header, indexes the chunks and starts the loader thread
+	bool open(std::string path);
+
+	//Width in pixels of a level file, read without opening it, the default level's if it can't be read
+	static int readWidth(std::string path);
+
+	//Stops the loader thread and drops every chunk
+	void close();
+
+	bool isOpen() const { return mThread != NULL; }
+
+	//Width in pixels, the default level's when none is open
+	int getWidth() const { return isOpen() ? mChunkCount * mChunkTilesX * mTileSize : LEVEL_WIDTH; }
+
+	//Requests chunks near the camera and evicts far ones, never waits on the loader
+	void update(const SDL_Rect& camera);
+
+	//Draws the resident tiles under the camera
+	void render(const SDL_Rect& camera);
+
+	//Picks up the tileset for the current theme
+	void reloadTileset();
+
+	//Changes whenever what render draws could have changed, for caching it
+	int getVersion() const { return mVersion; }
+
+	//Stats
+	int getResidentCount() const;
+	double getAverageLoadMs() const { return mLoads > 0 ? mTotalLoadMs / mLoads : 0.0; }
+	double getMaxLoadMs() const { return mMaxLoadMs; }
+	void printStats();
+
+private:
+	enum SlotState { SLOT_FREE, SLOT_LOADING, SLOT_READY };
+
+	struct ChunkRequest
+	{
+		int chunk;
+		int slot;
+		Uint64 requestTime;
+	};
+
+	struct ChunkResult
+	{
+		int chunk;
+		int slot;
+		bool ok;
+		Uint64 requestTime;
+		Uint64 doneTime;
+	};
+
+	//Reads the header lines and finds where each chunk starts
+	bool readHeader(std::string path);
+
+	//Parses one chunk's tile ids into a slot, runs on the loader thread
+	bool readChunk(std::ifstream& file, int chunk, Uint16* tiles);
+
+	static int loaderThread(void* data);
+
+	std::string mPath;
+	std::string mTilesetPath;
+	LTexture* mTileset;
+
+	int mTileSize;
+	int mChunkTilesX, mChunkTilesY;
+	int mChunkCount;
+
+	//File offset of each chunk's tile data
+	std::vector<std::streamoff> mChunkOffsets;
+
+	//Slot holding each chunk, -1 when it isn't resident
+	std::vector<int> mChunkSlot;
+
+	//Fixed chunk storage, a slot is owned by the loader while it is loading
+	std::vector<Uint16> mSlotTiles[MAX_RESIDENT_CHUNKS];
+	SlotState mSlotState[MAX_RESIDENT_CHUNKS];
+	int mSlotChunk[MAX_RESIDENT_CHUNKS];
+
+	SPSCQueue<ChunkRequest, 64> mRequests;
+	SPSCQueue<ChunkResult, 64> mResults;
+
+	//Posted for every queued request so the loader can sleep until there is work
+	SDL_sem* mSignal;
+
+	SDL_Thread* mThread;
+	std::atomic<bool> mRunning;
+
+	//Bumped on every chunk arriving or leaving and on tileset changes
+	int mVersion;
+
+	int mLoads;
+	int mFailedLoads;
+	int mEvictions;
+	double mTotalLoadMs;
+	double mMaxLoadMs;
+};
+
+//Records every rendered frame to a Y4M file without waiting on the disk
+class FrameCapture
+{
+public:
+	//Frames that can be waiting for the writer at once
+	static const int CAPTURE_BUFFERS = 4;
+
+	//Initializes variables
+	FrameCapture();
+
+	//Stops the writer thread
+	~FrameCapture();
+
+	//Opens the file, allocates the frame ring and starts the writer thread
+	bool start(std::string path, SDL_Renderer* renderer);
+
+	//Flushes queued frames and closes the file
+	void stop();
+
+	bool isCapturing() const { return mThread != NULL; }
+
+	//Copies the current frame out, call before SDL_RenderPresent
+	//Never waits on the writer, a frame with no free buffer is written as a repeat of the last one
+	void captureFrame(SDL_Renderer* renderer);
+
+	//Stats
+	void printStats();
+
+private:
+	//Converts one ARGB frame to I420 and writes it, runs on the writer thread
+	void writeFrame(const Uint32* pixels);
+
+	static int writerThread(void* data);
+
+	std::ofstream mFile;
+	int mWidth, mHeight;
+
+	//Readback buffers, each owned by the game or the writer at any time
+	std::vector<Uint32> mFrames[CAPTURE_BUFFERS];
+	SPSCQueue<int, CAPTURE_BUFFERS + 1> mFreeFrames;
+	SPSCQueue<int, CAPTURE_BUFFERS + 1> mFullFrames;
+
+	//Posted for every captured or repeated frame so the writer can sleep until there is work
+	SDL_sem* mSignal;
+
+	//Frames the writer still owes as copies of the last one it converted
+	std::atomic<int> mRepeats;
+
+	//Last buffer read back, repeated in place of a frame whose readback fails
+	int mLastFrame;
+
+	//Planar YUV scratch for the writer
+	std::vector<Uint8> mYUV;
+
+	SDL_Thread* mThread;
+	std::atomic<bool> mRunning;
+
+	int mCaptured;
+	int mDuplicated;
+	int mBehind;
+	std::atomic<int> mWritten;
+	double mReadbackMs;
+};
+
+//Renders the world offscreen at a scale that follows the frame time budget
+class DynamicResolution
+{
+public:
+	//Scale limits and how far one adjustment moves it
+	static constexpr float MIN_SCALE = 0.5f;
+	static constexpr float MAX_SCALE = 1.0f;
+	static constexpr float SCALE_STEP = 0.1f;
+
+	//Frames in a row over budget before scaling down
+	static const int DOWNSCALE_FRAMES = 10;
+
+	//Frames in a row with headroom before scaling up, longer so it doesn't flap
+	static const int UPSCALE_FRAMES = 60;
+
+	//Fraction of the budget a frame must stay under to count as headroom
+	static constexpr double HEADROOM = 0.7;
+
+	//Initializes variables
+	DynamicResolution();
+
+	//Frees the render target
+	~DynamicResolution();
+
+	//Creates the offscreen target, budget is the frame time to stay under in ms
+	bool init(SDL_Renderer* renderer, int width, int height, double budgetMs);
+
+	//Frees the render target
+	void free();
+
+	bool isEnabled() const { return mTarget != NULL; }
+
+	//Redirects world rendering into the scaled target
+	void beginWorld(SDL_Renderer* renderer);
+
+	//Upscales the world to the window, the HUD is drawn after this at native size
+	void endWorld(SDL_Renderer* renderer);
+
+	//Call right after SDL_RenderPresent, the time since the last present adjusts the scale for the next frame
+	//With vsync on, a budget between one and two refresh intervals scales down on missed vsyncs only
+	void framePresented();
+
+	float getScale() const { return mScale; }
+
+private:
+	SDL_Texture* mTarget;
+	int mWidth, mHeight;
+	double mBudgetMs;
+
+	float mScale;
+	int mOverBudgetFrames;
+	int mUnderBudgetFrames;
+
+	//Counter at the previous present, 0 before the first one
+	Uint64 mLastPresent;
+};
+
+//Layers that rarely change, kept in textures between frames
+//The HUD label is already its own texture and is copied at its rect, so it isn't one of these
+enum LayerId
+{
+	LAYER_BACKGROUND,
+	LAYER_TOTAL
+};
+
+//Caches static layers in render targets, redrawing one only when its view or content changes
+//Sprites are drawn over the cached layers every frame
+class LayerCompositor
+{
+public:
+	//Initializes variables
+	LayerCompositor();
+
+	//Frees the layer targets
+	~LayerCompositor();
+
+	//Creates a screen sized target per layer, false if the renderer can't draw into textures
+	bool init(SDL_Renderer* renderer, int width, int height);
+
+	//Frees the layer targets
+	void free();
+
+	bool isEnabled() const { return mRenderer != NULL; }
+
+	//Starts redrawing a layer if the view or content differ from what it holds
+	//Returns false when the cached copy is still good and nothing needs drawing
+	bool beginLayer(LayerId layer, const SDL_Rect& view, int content);
+
+	//Goes back to the target that was being drawn to before beginLayer
+	void endLayer();
+
+	//Copies a layer over the whole of the current target
+	void drawLayer(LayerId layer);
+
+	//Forces every layer to be redrawn, the renderer can lose target contents
+	void invalidateAll();
+
+	//Stats
+	int getHitRate(LayerId layer) const;
+	void printStats();
+
+private:
+	struct Layer
+	{
+		SDL_Texture* target;
+		bool valid;
+
+		//What the cached copy was drawn for
+		SDL_Rect view;
+		int content;
+
+		long long hits;
+		long long misses;
+	};
+
+	SDL_Renderer* mRenderer;
+	int mWidth, mHeight;
+	Layer mLayers[LAYER_TOTAL];
+
+	//Target to go back to after a layer is redrawn
+	SDL_Texture* mPreviousTarget;
+};
+
+//Ring of recent simulation states for rewind and rollback
+class SnapshotRing
+{
+public:
+	//Frames kept, two seconds at 60 FPS
+	static const int SNAPSHOT_FRAMES = 120;
+
+	//Initializes variables, frame buffers are allocated as they are first used
+	SnapshotRing();
+
+	//Records the current frame, overwriting the oldest one when full
+	void save(const SimContext& sim, const Dot& dot, const WaveSpawner& waves);
+
+	//Puts the simulation back the given number of frames, returns false if that frame isn't kept
+	bool restore(int framesBack, SimContext& sim, Dot& dot, WaveSpawner& waves);
+
+	//Stats
+	int getCount() const { return mCount; }
+	double getLastSaveMicros() const { return mLastSaveMicros; }
+	double getLastRestoreMicros() const { return mLastRestoreMicros; }
+	int getLastSize() const { return mLastSize; }
+
+private:
+	std::vector<Uint8> mFrames[SNAPSHOT_FRAMES];
+
+	//Slot the next save goes into
+	int mHead;
+	int mCount;
+
+	double mLastSaveMicros;
+	double mLastRestoreMicros;
+	int mLastSize;
+};
+
+//One group of enemies in the wave schedule
+struct Wave
+{
+	int startFrame;		//frame the wave appears on
+	int count;			//enemies in the wave
+	int spawnX, spawnY;	//where the first enemy stands
+	int spacing;		//horizontal gap between enemies, rows wrap at the level edge
+};
+
+//Spawns enemies from a preallocated pool following a wave schedule
+class WaveSpawner
+{
+public:
+	//Size of the enemy pool, nothing is allocated after construction
+	static const int MAX_ENEMIES = 4096;
+
+	//Side of a broad-phase grid cell, a few enemies wide
+	static const int GRID_CELL = 64;
+
+	//Preallocates the pool and sets up the default schedule
+	WaveSpawner();
+
+	//Replaces the schedule with one that ramps up to the given number of enemies
+	void setStressSchedule(int targetEnemies);
+
+	//Spawns due waves, moves enemies and returns dead ones to the pool
+	void update(const SimContext& sim);
+
+	//Shows every live enemy
+	void render(int camX, int camY);
+
+	//First live enemy overlapping the box, NULL if none
+	Enemy* findCollision(SDL_Rect box);
+
+	//Earliest live enemy hit by the shape moving by (velX, velY) this tick, NULL if none
+	//toi gets the fraction of the move made before touching it
+	//Only looks in the grid cells the move covers, the grid is rebuilt by update
+	Enemy* findSweptCollision(const CollisionShape& shape, float velX, float velY, float* toi);
+
+	//Copies every live enemy out for drawing
+	void copyActive(std::vector<Enemy>& out) const;
+
+	//Copies the pool state in and out of a snapshot
+	void saveState(std::vector<Uint8>& out) const;
+	void loadState(const Uint8*& in);
+
+	//Stats
+	int getActiveCount() const { return (int)mActive.size(); }
+	int getPeakCount() const { return mPeak; }
+	int getFreeCount() const { return (int)mFreeList.size(); }
+	int getDroppedCount() const { return mDropped; }
+
+private:
+	//Takes an enemy out of the pool, returns false when the pool is empty
+	bool spawnEnemy(int x, int y);
+
+	//Files every live enemy under each grid cell its collider touches
+	void buildGrid(int levelWidth);
+
+	//Grid cells covered by a box, clamped to the grid
+	void getCellRange(const SDL_Rect& box, int& firstColumn, int& firstRow, int& lastColumn, int& lastRow) const;
+
+	std::vector<Enemy> mPool;
+	std::vector<int> mFreeList;
+	std::vector<int> mActive;
+
+	//Broad-phase grid: pool indices of each cell's enemies stored back to back, cell c's run starts at mCellStart[c]
+	int mGridColumns, mGridRows;
+	std::vector<int> mCellStart;
+	std::vector<int> mCellFill;
+	std::vector<int> mCellEnemies;
+
+	//Query each enemy was last visited by, so one spanning several cells is only swept once
+	std::vector<Uint32> mVisited;
+	Uint32 mQuery;
+
+	//Broad-phase survivors for swept tests, reused every call
+	std::vector<CollisionShape> mSweepShapes;
+	std::vector<int> mSweepIndices;
+
+	std::vector<Wave> mSchedule;
+	size_t mNextWave;
+	int mFrame;
+
+	int mPeak;
+	int mDropped;
+};
+
+//Everything the renderer needs from one simulated frame
+//Entities are copied so the frame can be drawn while the next one is simulated
+struct RenderFrame
+{
+	Uint32 simFrame;
+	SDL_Rect camera;
+	Dot dot;
+	std::vector<Enemy> enemies;
+	std::vector<Projectile> projectiles;
+	std::vector<EffectEvent> effects;
+	std::vector<SoundId> sounds;
+
+	//Pool usage for telemetry
+	int activeEnemies;
+	int projectileCapacity;
+};
+
+//The game world, stepped one frame at a time
+//Owns all of its state, so any number can run at once; clip definitions are shared and read-only
+class Simulation
+{
+public:
+	//Initializes variables
+	Simulation();
+
+	WaveSpawner& getWaves() { return mWaves; }
+	const Dot& getDot() const { return mDot; }
+	Uint32 getFrame() const { return mContext.frame; }
+
+	//Sets the width of the level being played
+	void setLevelWidth(int width) { mContext.levelWidth = width; }
+
+	//Turns saving frames for rewind on or off, headless runs don't need it
+	void setRecording(bool recording) { mRecording = recording; }
+
+	//Runs one frame: input, movement and collisions
+	void step(const SDL_Event* events, int eventCount);
+
+	//True for the key events step acts on, nothing else needs passing in
+	static bool isInput(const SDL_Event& e);
+
+	//Copies what the renderer needs for the frame just simulated into out
+	void copyFrame(RenderFrame& out);
+
+private:
+	//Handles input that belongs to the simulation
+	void handleEvent(SDL_Event& e);
+
+	//Frame counter, projectiles and what this frame wants drawn and played
+	SimContext mContext;
+
+	//The dot that will be moving around on the screen
+	Dot mDot;
+
+	//Enemies come in waves out of a fixed pool
+	WaveSpawner mWaves;
+
+	//Recent frames for rewinding
+	SnapshotRing mSnapshots;
+	bool mRecording;
+
+	//Arrow keys held as of the last event, left out of snapshots so a rewind keeps them
+	bool mHeldLeft, mHeldRight;
+
+	//The camera area
+	SDL_Rect mCamera;
+};
+
+//Runs the simulation on its own thread one frame ahead of rendering
+//Frames are handed over through lock-free queues of buffer indices
+class SimulationPipeline
+{
+public:
+	//Frame buffers: one being drawn, one being simulated or waiting to be drawn
+	//The simulation can't get more than one frame ahead, so input isn't shown late
+	static const int PIPELINE_FRAMES = 2;
+
+	//Input events that can be waiting for the simulation
+	static const unsigned EVENT_QUEUE_SIZE = 256;
+
+	//Initializes variables
+	SimulationPipeline();
+
+	//Stops the simulation thread
+	~SimulationPipeline();
+
+	//Starts simulating on a thread
+	bool start(Simulation* simulation);
+
+	//Stops the thread, the simulation can be stepped directly again afterwards
+	void stop();
+
+	bool isRunning() const { return mThread != NULL; }
+
+	//Passes an input event to the simulation thread, never waits
+	//When the queue is full the event is kept back and retried, so none is lost or reordered
+	void postEvent(const SDL_Event& e);
+
+	//Gets the next simulated frame, waiting if the simulation is behind
+	//Events kept back by postEvent are retried first
+	RenderFrame* acquireFrame();
+
+	//Hands a drawn frame back for reuse
+	void releaseFrame(RenderFrame* frame);
+
+	//Stats
+	int getRenderStalls() const { return mRenderStalls.load(); }
+	int getSimulationStalls() const { return mSimulationStalls.load(); }
+	void printStats();
+
+private:
+	static int simulationThread(void* data);
+
+	//Moves events kept back by postEvent into the queue, in order, until it fills again
+	void flushOverflow();
+
+	Simulation* mSimulation;
+	RenderFrame mFrames[PIPELINE_FRAMES];
+
+	//Buffer indices ready for the simulation and ready for drawing
+	SPSCQueue<int, PIPELINE_FRAMES + 1> mFreeFrames;
+	SPSCQueue<int, PIPELINE_FRAMES + 1> mReadyFrames;
+	SPSCQueue<SDL_Event, EVENT_QUEUE_SIZE> mEvents;
+
+	//Events that didn't fit in mEvents, only touched by the thread posting them
+	std::vector<SDL_Event> mOverflow;
+
+	//Only used to sleep when a queue is empty, the handoff itself doesn't lock
+	SDL_sem* mFreeSignal;
+	SDL_sem* mReadySignal;
+
+	SDL_Thread* mThread;
+	std::atomic<bool> mRunning;
+
+	//Times the renderer waited for the simulation, and the other way round
+	std::atomic<int> mRenderStalls;
+	std::atomic<int> mSimulationStalls;
+	std::atomic<Uint64> mRenderStallTicks;
+	std::atomic<Uint64> mSimulationStallTicks;
+	std::atomic<int> mFramesSimulated;
+	int mEventOverflows;
+};
+
+//Runs many headless simulations side by side on a pool of worker threads
+//Each instance is played by a scripted player, for automated playtests and balancing sweeps
+class BatchRunner
+{
+public:
+	//Frames between the scripted player's decisions, half a second at 60 FPS
+	static const int DECISION_FRAMES = 30;
+
+	//Initializes variables
+	BatchRunner();
+
+	//Simulates every instance for up to frames frames, returns when all are done
+	void run(int instances, int frames, int stressEnemies, int levelWidth);
+
+	//Prints how each instance ended and how fast the batch ran
+	void printStats();
+
+private:
+	//How one instance ended
+	struct Result
+	{
+		Uint32 seed;
+		int health;
+		Uint32 deathFrame;	//0 if the dot survived
+		int peakEnemies;
+		int droppedEnemies;
+	};
+
+	static int workerThread(void* data);
+
+	//Takes instances off the batch until none are left
+	void work();
+
+	//Plays one instance to the end
+	void runInstance(int index);
+
+	int mFrames;
+	int mStressEnemies;
+	int mLevelWidth;
+
+	//One per instance, each written by whichever worker ran it
+	std::vector<Result> mResults;
+
+	//Next instance to hand to a worker
+	std::atomic<int> mNextInstance;
+
+	int mThreadCount;
+	double mElapsedMs;
+};
+
+//Starts up SDL and creates window
+bool init();
+
+//Defines the animation clips and builds their collision masks, needs no renderer
+bool loadAnimations();
+
+//Loads media
+bool loadMedia();
+
+//Frees media and shuts down SDL
+void close();
+
+
+
+TTF_Font* gFont = NULL;
+
+LTexture gTextTexture;
+
+//Health the HUD text was last rendered for, the text is only rebuilt when it changes
+int gHealthShown = -1;
+
+
+//walking animation
+const int WALKING_ANIMATION_FRAMES = 10;
+LTexture gWalkingSheetTexture;
+
+//IDLE animation
+const int IDLE_ANIMATION_FRAMES = 6;
+LTexture gIdleSheetTexture;
+
+//enemy animation
+const int ENEMY_ANIMATION_FRAMES = 6;
+LTexture gEnemyTexture;
+//one-off animations
+LTexture gShotSheetTexture;
+LTexture gHurtSheetTexture;
+LTexture gDeadSheetTexture;
+LTexture gEnemyHurtTexture;
+LTexture gEnemyDeadTexture;
+
+//Image and texture behind each clip
+const char* const gClipSheets[CLIP_TOTAL] =
+{
+	"Gangsters_1/Idle.png",
+	"Gangsters_1/Run.png",
+	"Gangsters_1/Shot.png",
+	"Gangsters_1/Hurt.png",
+	"Gangsters_1/Dead.png",
+	"Gangsters_2/Idle.png",
+	"Gangsters_2/Hurt.png",
+	"Gangsters_2/Dead.png"
+};
+LTexture* const gClipTextures[CLIP_TOTAL] =
+{
+	&gIdleSheetTexture,
+	&gWalkingSheetTexture,
+	&gShotSheetTexture,
+	&gHurtSheetTexture,
+	&gDeadSheetTexture,
+	&gEnemyTexture,
+	&gEnemyHurtTexture,
+	&gEnemyDeadTexture
+};
+
+//Scene textures
+LTexture gDotTexture;
+LTexture* gBGTexture = NULL;
+
+//Current theme for the level art
+Theme gTheme = THEME_BRIGHT;
+
+
+
+
+LTexture::LTexture()
+{
+	//Initialize
+	mTexture = NULL;
+	mWidth = 0;
+	mHeight = 0;
+	mBytes = 0;
+	gTelemetry.onTextureObject(1);
+}
+
+LTexture::~LTexture()
+{
+	//Deallocate
+	free();
+	gTelemetry.onTextureObject(-1);
+}
+
+void LTexture::track(const std::string& asset)
+{
+	Uint32 format = 0;
+	SDL_QueryTexture(mTexture, &format, NULL, NULL, NULL);
+	int bytesPerPixel = SDL_BYTESPERPIXEL(format);
+	if (bytesPerPixel == 0)
+	{
+		bytesPerPixel = 4;
+	}
+
+	mAsset = asset;
+	mBytes = (long long)mWidth * mHeight * bytesPerPixel;
+	gTelemetry.onTextureCreated(mAsset, mBytes);
+}
+
+const PaletteVariant gPaletteVariants[THEME_TOTAL] =
+{
+	{ "Bright", 256, 0 },
+	{ "Pale", 140, 70 }
+};
+
+//Recolours a surface for a theme through a per-channel lookup table
+//Returns the surface to use, which may be a converted copy
+SDL_Surface* applyPaletteVariant(SDL_Surface* surface, Theme theme)
+{
+	const PaletteVariant& variant = gPaletteVariants[theme];
+
+	//Tone curve, built once per call since loads are rare
+	Uint8 lut[256];
+	for (int i = 0; i < 256; ++i)
+	{
+		lut[i] = (Uint8)(variant.lift + i * (255 - variant.lift) / 255);
+	}
+
+	//Indexed images only need their palette touched
+	SDL_Palette* palette = surface->format->palette;
+	if (palette != NULL)
+	{
+		for (int i = 0; i < palette->ncolors; ++i)
+		{
+			SDL_Color& c = palette->colors[i];
+
+			//Leave the colour key alone so it still matches
+			if (c.r == 0 && c.g == 0xFF && c.b == 0xFF)
+			{
+				continue;
+			}
+			int lum = (77 * c.r + 150 * c.g + 29 * c.b) >> 8;
+			c.r = lut[lum + (((c.r - lum) * variant.saturation) >> 8)];
+			c.g = lut[lum + (((c.g - lum) * variant.saturation) >> 8)];
+			c.b = lut[lum + (((c.b - lum) * variant.saturation) >> 8)];
+		}
+		return surface;
+	}
+
+	//Everything else goes through a known 32-bit layout
+	if (surface->format->format != SDL_PIXELFORMAT_ARGB8888)
+	{
+		SDL_Surface* converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+		if (converted == NULL)
+		{
+			printf("Unable to convert surface for %s theme! SDL Error: %s\n", variant.name, SDL_GetError());
+			return surface;
+		}
+		SDL_FreeSurface(surface);
+		surface = converted;
+	}
+
+	SDL_LockSurface(surface);
+	for (int y = 0; y < surface->h; ++y)
+	{
+		Uint32* row = (Uint32*)((Uint8*)surface->pixels + y * surface->pitch);
+		for (int x = 0; x < surface->w; ++x)
+		{
+			Uint32 pixel = row[x];
+			if ((pixel & 0x00FFFFFF) == 0x0000FFFF)
+			{
+				continue;
+			}
+			int r = (pixel >> 16) & 0xFF;
+			int g = (pixel >> 8) & 0xFF;
+			int b = pixel & 0xFF;
+			int lum = (77 * r + 150 * g + 29 * b) >> 8;
+			r = lut[lum + (((r - lum) * variant.saturation) >> 8)];
+			g = lut[lum + (((g - lum) * variant.saturation) >> 8)];
+			b = lut[lum + (((b - lum) * variant.saturation) >> 8)];
+			row[x] = (pixel & 0xFF000000) | (r << 16) | (g << 8) | b;
+		}
+	}
+	SDL_UnlockSurface(surface);
+
+	return surface;
+}
+
+bool LTexture::loadFromFile(std::string path)
+{
+	//Get rid of preexisting texture
+	free();
+
+	//Load image at specified path
+	SDL_Surface* loadedSurface = IMG_Load(path.c_str());
+	if (loadedSurface == NULL)
+	{
+		printf("Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
+	}
+	else
+	{
+		loadFromSurface(loadedSurface, path);
+
+		//Get rid of old loaded surface
+		SDL_FreeSurface(loadedSurface);
+	}
+
+	//Return success
+	return mTexture != NULL;
+}
+
+bool LTexture::loadFromSurface(SDL_Surface* surface, const std::string& asset)
+{
+	//Get rid of preexisting texture
+	free();
+
+	//Color key image
+	SDL_SetColorKey(surface, SDL_TRUE, SDL_MapRGB(surface->format, 0, 0xFF, 0xFF));
+
+	//Create texture from surface pixels
+	mTexture = SDL_CreateTextureFromSurface(gRenderer, surface);
+	if (mTexture == NULL)
+	{
+		printf("Unable to create texture from %s! SDL Error: %s\n", asset.c_str(), SDL_GetError());
+		return false;
+	}
+
+	//Get image dimensions
+	mWidth = surface->w;
+	mHeight = surface->h;
+	track(asset);
+	return true;
+}
+
+bool LTexture::loadFromRenderedText(std::string textureText, SDL_Color textColor)
+{
+	free();
+	SDL_Surface* textSurface = TTF_RenderText_Solid(gFont, textureText.c_str(), textColor);
+	if (textSurface == NULL)
+	{
+		printf("unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError());
+	}
+	else
+	{
+		mTexture = SDL_CreateTextureFromSurface(gRenderer, textSurface);
+		if (mTexture == NULL)
+		{
+			printf("unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError());
+
+		}
+		else
+		{
+			mWidth = textSurface->w;
+			mHeight = textSurface->h;
+			track("rendered text");
+		}
+		SDL_FreeSurface(textSurface);
+	}
+	return mTexture != NULL;
+}
+
+bool checkCollision(SDL_Rect a, SDL_Rect b)
+{
+	// The sides of the rectangles
+	int leftA = a.x;
+	int rightA = a.x + a.w;
+	int topA = a.y;
+	int bottomA = a.y + a.h;
+
+	int leftB = b.x;
+	int rightB = b.x + b.w;
+	int topB = b.y;
+	int bottomB = b.y + b.h;
+
+	// Check if rectangles overlap
+	if (bottomA <= topB)
+	{
+		return false;
+	}
+
+	if (topA >= bottomB)
+	{
+		return false;
+	}
+
+	if (rightA <= leftB)
+	{
+		return false;
+	}
+
+	if (leftA >= rightB)
+	{
+		return false;
+	}
+
+	// If none of the sides are outside, the rectangles overlap
+	return true;
+}
+
+//Swept box test: does a, moving by (velX, velY), overlap b at some point of the move?
+//toi gets the fraction of the move where they first overlap, 0 if they already do
+//Boxes that already overlap and are moving out along the shallower axis don't hit, so they can separate
+bool sweepCollision(SDL_Rect a, float velX, float velY, SDL_Rect b, float* toi)
+{
+	//Grow b by a's size so a can be treated as a point at its top left corner
+	float left = (float)(b.x - a.w);
+	float right = (float)(b.x + b.w);
+	float top = (float)(b.y - a.h);
+	float bottom = (float)(b.y + b.h);
+
+	float enter = -1.0f;
+	float exit = 2.0f;
+
+	//Time the point spends inside each slab, edges touching don't count as a hit
+	if (velX == 0.0f)
+	{
+		if (a.x <= left || a.x >= right)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		float t0 = (left - a.x) / velX;
+		float t1 = (right - a.x) / velX;
+		if (t0 > t1)
+		{
+			float swap = t0;
+			t0 = t1;
+			t1 = swap;
+		}
+		enter = t0 > enter ? t0 : enter;
+		exit = t1 < exit ? t1 : exit;
+	}
+
+	if (velY == 0.0f)
+	{
+		if (a.y <= top || a.y >= bottom)
+		{
+			return false;
+		}
+	}
+	else
+	{
+		float t0 = (top - a.y) / velY;
+		float t1 = (bottom - a.y) / velY;
+		if (t0 > t1)
+		{
+			float swap = t0;
+			t0 = t1;
+			t1 = swap;
+		}
+		enter = t0 > enter ? t0 : enter;
+		exit = t1 < exit ? t1 : exit;
+	}
+
+	if (enter >= exit || enter >= 1.0f || exit <= 0.0f)
+	{
+		return false;
+	}
+
+	if (checkCollision(a, b))
+	{
+		//Already inside, the side it is closest to is the way out
+		float depthLeft = a.x - left;
+		float depthRight = right - a.x;
+		float depthTop = a.y - top;
+		float depthBottom = bottom - a.y;
+		float depthX = depthLeft < depthRight ? depthLeft : depthRight;
+		float depthY = depthTop < depthBottom ? depthTop : depthBottom;
+		if (depthX <= depthY)
+		{
+			if ((depthLeft < depthRight && velX < 0.0f) || (depthLeft >= depthRight && velX > 0.0f))
+			{
+				return false;
+			}
+		}
+		else if ((depthTop < depthBottom && velY < 0.0f) || (depthTop >= depthBottom && velY > 0.0f))
+		{
+			return false;
+		}
+
+		*toi = 0.0f;
+		return true;
+	}
+
+	*toi = enter < 0.0f ? 0.0f : enter;
+	return true;
+}
+
+#ifdef _DEBUG
+//Cases the swept test has got wrong before, checked once at startup
+void checkSweepCollision()
+{
+	SDL_Rect wall = { 100, 0, 20, 20 };
+	float toi = -1.0f;
+
+	//Moving into a box from outside stops at the edge
+	SDL_Rect outside = { 70, 0, 20, 20 };
+	SDL_assert(sweepCollision(outside, 20.0f, 0.0f, wall, &toi) && toi == 0.5f);
+
+	//Sliding past never touches
+	SDL_Rect above = { 70, -30, 20, 20 };
+	SDL_assert(!sweepCollision(above, 60.0f, 0.0f, wall, &toi));
+
+	//Inside and pushing deeper is blocked straight away
+	SDL_Rect inside = { 85, 2, 20, 20 };
+	SDL_assert(sweepCollision(inside, 5.0f, 0.0f, wall, &toi) && toi == 0.0f);
+
+	//Inside and backing out the near side is let go
+	SDL_assert(!sweepCollision(inside, -5.0f, 0.0f, wall, &toi));
+
+	//Inside but moving along the deep axis only is still blocked
+	SDL_assert(sweepCollision(inside, 0.0f, -5.0f, wall, &toi) && toi == 0.0f);
+}
+#endif
+
+//Do the shapes share a solid pixel with a moved by (offsetX, offsetY)?
+bool shapesOverlap(const CollisionShape& a, int offsetX, int offsetY, const CollisionShape& b)
+{
+	//Boxes first, the masks only matter where they meet
+	SDL_Rect box = a.box;
+	box.x += offsetX;
+	box.y += offsetY;
+	if (!checkCollision(box, b.box))
+	{
+		return false;
+	}
+
+	if (a.mask != NULL && b.mask != NULL)
+	{
+		return a.mask->overlaps(a.x + offsetX, a.y + offsetY, *b.mask, b.x, b.y);
+	}
+	if (a.mask != NULL)
+	{
+		return a.mask->overlapsRect(a.x + offsetX, a.y + offsetY, b.box);
+	}
+	if (b.mask != NULL)
+	{
+		return b.mask->overlapsRect(b.x, b.y, box);
+	}
+	return true;
+}
+
+//Swept test that goes down to the pixel when either shape has a mask
+//toi gets the fraction of the move before the first solid pixels touch
+bool sweepShapes(const CollisionShape& a, float velX, float velY, const CollisionShape& b, float* toi)
+{
+	float boxToi;
+	if (!sweepCollision(a.box, velX, velY, b.box, &boxToi))
+	{
+		return false;
+	}
+	if (a.mask == NULL && b.mask == NULL)
+	{
+		*toi = boxToi;
+		return true;
+	}
+
+	//Walk the rest of the move a pixel at a time from where the boxes meet
+	float distance = fabs(velX) > fabs(velY) ? fabs(velX) : fabs(velY);
+	int steps = distance < 1.0f ? 1 : (int)ceil(distance);
+	for (int step = (int)(boxToi * steps); step <= steps; ++step)
+	{
+		int offsetX = (int)lroundf(velX * step / steps);
+		int offsetY = (int)lroundf(velY * step / steps);
+		if (shapesOverlap(a, offsetX, offsetY, b))
+		{
+			*toi = step > 0 ? (float)(step - 1) / steps : 0.0f;
+			return true;
+		}
+	}
+	return false;
+}
+
+//Sweeps one moving shape against many, returns the index of the earliest hit or -1
+int sweepCollisionBatch(const CollisionShape& a, float velX, float velY, const CollisionShape* targets, int count, float* toi)
+{
+	int hit = -1;
+	float best = 1.0f;
+	for (int i = 0; i < count; ++i)
+	{
+		float t;
+		if (sweepShapes(a, velX, velY, targets[i], &t) && (hit < 0 || t < best))
+		{
+			hit = i;
+			best = t;
+		}
+	}
+
+	if (hit >= 0)
+	{
+		*toi = best;
+	}
+	return hit;
+}
+
+//Box covering a's whole move, for broad-phase culling before sweeping
+SDL_Rect sweptBounds(SDL_Rect a, float velX, float velY)
+{
+	int dx = (int)ceil(fabs(velX));
+	int dy = (int)ceil(fabs(velY));
+	SDL_Rect bounds = { velX < 0.0f ? a.x - dx : a.x, velY < 0.0f ? a.y - dy : a.y, a.w + dx, a.h + dy };
+	return bounds;
+}
+
+
+
+void LTexture::free()
+{
+	//Free texture if it exists
+	if (mTexture != NULL)
+	{
+		gTelemetry.onTextureDestroyed(mAsset, mBytes);
+		SDL_DestroyTexture(mTexture);
+		mTexture = NULL;
+		mWidth = 0;
+		mHeight = 0;
+		mBytes = 0;
+	}
+}
+
+void LTexture::setColor(Uint8 red, Uint8 green, Uint8 blue)
+{
+	//Modulate texture rgb
+	SDL_SetTextureColorMod(mTexture, red, green, blue);
+}
+
+void LTexture::setBlendMode(SDL_BlendMode blending)
+{
+	//Set blending function
+	SDL_SetTextureBlendMode(mTexture, blending);
+}
+
+void LTexture::setAlpha(Uint8 alpha)
+{
+	//Modulate texture alpha
+	SDL_SetTextureAlphaMod(mTexture, alpha);
+}
+
+void LTexture::render(int x, int y, SDL_Rect* clip, double angle, SDL_Point* center, SDL_RendererFlip flip)
+{
+	//Set rendering space and render to screen
+	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+
+	//Set clip rendering dimensions
+	if (clip != NULL)
+	{
+		renderQuad.w = clip->w;
+		renderQuad.h = clip->h;
+	}
+
+	//Render to screen
+	SDL_RenderCopyEx(gRenderer, mTexture, clip, &renderQuad, angle, center, flip);
+}
+
+int LTexture::getWidth()
+{
+	return mWidth;
+}
+
+int LTexture::getHeight()
+{
+	return mHeight;
+}
+
+Telemetry::Telemetry()
+{
+	mTextureObjects = 0;
+	mLiveTextures = 0;
+	mTextureBytes = 0;
+	mPeakTextureBytes = 0;
+	mTexturesCreated = 0;
+	mTexturesDestroyed = 0;
+	mCreatedAtLastRefresh = 0;
+	mCreatedPerSecond = 0.0;
+	mDumpTime = 0;
+	mOverlayVisible = false;
+	mOverlayTime = 0;
+
+	for (int i = 0; i < OVERLAY_LINES; ++i)
+	{
+		mOverlay[i] = NULL;
+	}
+}
+
+void Telemetry::onTextureObject(int delta)
+{
+	mTextureObjects += delta;
+}
+
+void Telemetry::onTextureCreated(const std::string& asset, long long bytes)
+{
+	++mLiveTextures;
+	++mTexturesCreated;
+	mTextureBytes += bytes;
+	if (mTextureBytes > mPeakTextureBytes)
+	{
+		mPeakTextureBytes = mTextureBytes;
+	}
+
+	AssetStats& stats = mAssets[asset];
+	++stats.count;
+	stats.bytes += bytes;
+	if (stats.bytes > stats.peakBytes)
+	{
+		stats.peakBytes = stats.bytes;
+	}
+}
+
+void Telemetry::onTextureDestroyed(const std::string& asset, long long bytes)
+{
+	--mLiveTextures;
+	++mTexturesDestroyed;
+	mTextureBytes -= bytes;
+
+	AssetStats& stats = mAssets[asset];
+	--stats.count;
+	stats.bytes -= bytes;
+}
+
+void Telemetry::setGauge(const std::string& name, long long value)
+{
+	Gauge& gauge = mGauges[name];
+	gauge.value = value;
+	if (value > gauge.peak)
+	{
+		gauge.peak = value;
+	}
+}
+
+bool Telemetry::openDump(std::string path)
+{
+	mDump.open(path.c_str(), std::ios::out | std::ios::app);
+	if (!mDump)
+	{
+		printf("Unable to open telemetry dump %s!\n", path.c_str());
+		return false;
+	}
+	mDumpTime = SDL_GetTicks();
+	return true;
+}
+
+void Telemetry::update()
+{
+	Uint32 now = SDL_GetTicks();
+	if (mDump.is_open() && now - mDumpTime >= DUMP_INTERVAL)
+	{
+		writeDump();
+		mDumpTime = now;
+	}
+}
+
+void Telemetry::writeDump()
+{
+	mDump << "{\"ticks\":" << SDL_GetTicks()
+		<< ",\"textures\":{\"objects\":" << mTextureObjects
+		<< ",\"live\":" << mLiveTextures
+		<< ",\"bytes\":" << mTextureBytes
+		<< ",\"peak_bytes\":" << mPeakTextureBytes
+		<< ",\"created\":" << mTexturesCreated
+		<< ",\"destroyed\":" << mTexturesDestroyed << "}";
+
+	//Asset paths are plain relative paths, no escaping needed
+	mDump << ",\"assets\":{";
+	bool first = true;
+	for (std::map<std::string, AssetStats>::iterator it = mAssets.begin(); it != mAssets.end(); ++it)
+	{
+		mDump << (first ? "" : ",") << "\"" << it->first << "\":{\"count\":" << it->second.count
+			<< ",\"bytes\":" << it->second.bytes << ",\"peak_bytes\":" << it->second.peakBytes << "}";
+		first = false;
+	}
+
+	mDump << "},\"gauges\":{";
+	first = true;
+	for (std::map<std::string, Gauge>::iterator it = mGauges.begin(); it != mGauges.end(); ++it)
+	{
+		mDump << (first ? "" : ",") << "\"" << it->first << "\":{\"value\":" << it->second.value
+			<< ",\"peak\":" << it->second.peak << "}";
+		first = false;
+	}
+	mDump << "}}\n";
+	mDump.flush();
+}
+
+void Telemetry::renderOverlay()
+{
+	if (!mOverlayVisible)
+	{
+		return;
+	}
+
+	//Rebuilding the text makes textures too, so only do it now and then
+	Uint32 now = SDL_GetTicks();
+	if (mOverlayTime == 0 || now - mOverlayTime >= OVERLAY_INTERVAL)
+	{
+		double seconds = mOverlayTime == 0 ? 0.0 : (now - mOverlayTime) / 1000.0;
+		mCreatedPerSecond = seconds > 0.0 ? (mTexturesCreated - mCreatedAtLastRefresh) / seconds : 0.0;
+		mOverlayTime = now;
+
+		std::string lines[OVERLAY_LINES];
+		char text[128];
+		snprintf(text, sizeof(text), "Textures: %d live, %d objects", mLiveTextures, mTextureObjects);
+		lines[0] = text;
+		snprintf(text, sizeof(text), "Texture KB: %lld (peak %lld)", mTextureBytes / 1024, mPeakTextureBytes / 1024);
+		lines[1] = text;
+		snprintf(text, sizeof(text), "Texture creations/s: %.0f", mCreatedPerSecond);
+		lines[2] = text;
+
+		int line = 3;
+		for (std::map<std::string, Gauge>::iterator it = mGauges.begin(); it != mGauges.end() && line < OVERLAY_LINES; ++it, ++line)
+		{
+			snprintf(text, sizeof(text), "%s: %lld (peak %lld)", it->first.c_str(), it->second.value, it->second.peak);
+			lines[line] = text;
+		}
+
+		SDL_Color textColor = { 255, 255, 0, 255 };
+		for (int i = 0; i < OVERLAY_LINES; ++i)
+		{
+			if (mOverlay[i] == NULL)
+			{
+				mOverlay[i] = new LTexture();
+			}
+			else if (lines[i] == mOverlayText[i])
+			{
+				continue;
+			}
+			mOverlayText[i] = lines[i];
+
+			if (lines[i].empty())
+			{
+				mOverlay[i]->free();
+			}
+			else
+			{
+				mOverlay[i]->loadFromRenderedText(lines[i], textColor);
+			}
+		}
+
+		//Taken after the rebuild so the overlay's own textures don't show up as churn
+		mCreatedAtLastRefresh = mTexturesCreated;
+	}
+
+	int y = 10;
+	for (int i = 0; i < OVERLAY_LINES; ++i)
+	{
+		if (mOverlay[i] != NULL && mOverlay[i]->getWidth() > 0)
+		{
+			mOverlay[i]->render(SCREEN_WIDTH - mOverlay[i]->getWidth() - 10, y);
+			y += mOverlay[i]->getHeight();
+		}
+	}
+}
+
+void Telemetry::free()
+{
+	for (int i = 0; i < OVERLAY_LINES; ++i)
+	{
+		delete mOverlay[i];
+		mOverlay[i] = NULL;
+		mOverlayText[i].clear();
+	}
+	if (mDump.is_open())
+	{
+		writeDump();
+		mDump.close();
+	}
+}
+
+AudioEngine::AudioEngine()
+{
+	mOpened = false;
+	mEnabled = false;
+	mRunning = false;
+	mThread = NULL;
+	mSignal = NULL;
+	mDropped = 0;
+	mStolen = 0;
+
+	for (int i = 0; i < SOUND_TOTAL; ++i)
+	{
+		mChunks[i] = NULL;
+	}
+	for (int i = 0; i < AUDIO_CHANNELS; ++i)
+	{
+		mChannelSound[i] = SOUND_SHOT;
+		mChannelStart[i] = 0;
+	}
+}
+
+bool AudioEngine::init()
+{
+	//Audio is optional, set SDL_AUDIODRIVER=dummy or disk to run headless
+	if (SDL_InitSubSystem(SDL_INIT_AUDIO) < 0)
+	{
+		printf("Warning: SDL audio could not initialize! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+
+	if (Mix_OpenAudio(MIX_DEFAULT_FREQUENCY, MIX_DEFAULT_FORMAT, 2, 1024) < 0)
+	{
+		printf("Warning: SDL_mixer could not initialize! SDL_mixer Error: %s\n", Mix_GetError());
+		SDL_QuitSubSystem(SDL_INIT_AUDIO);
+		return false;
+	}
+	mOpened = true;
+
+	Mix_AllocateChannels(AUDIO_CHANNELS);
+
+	//Preload every chunk so nothing touches the disk during play
+	mChunks[SOUND_SHOT] = loadChunk(SOUND_SHOT, "Sounds/shot.wav");
+	mChunks[SOUND_HIT] = loadChunk(SOUND_HIT, "Sounds/hit.wav");
+	mChunks[SOUND_ENEMY_DEAD] = loadChunk(SOUND_ENEMY_DEAD, "Sounds/enemy_dead.wav");
+
+	mSignal = SDL_CreateSemaphore(0);
+	if (mSignal == NULL)
+	{
+		printf("Warning: audio semaphore could not be created! SDL Error: %s\n", SDL_GetError());
+		close();
+		return false;
+	}
+
+	mRunning = true;
+	mThread = SDL_CreateThread(audioThread, "AudioThread", this);
+	if (mThread == NULL)
+	{
+		printf("Warning: audio thread could not be created! SDL Error: %s\n", SDL_GetError());
+		mRunning = false;
+		close();
+		return false;
+	}
+
+	printf("Audio started on driver %s\n", SDL_GetCurrentAudioDriver());
+	mEnabled = true;
+	return true;
+}
+
+Mix_Chunk* AudioEngine::loadChunk(SoundId sound, const char* path)
+{
+	Mix_Chunk* chunk = Mix_LoadWAV(path);
+	if (chunk != NULL)
+	{
+		return chunk;
+	}
+
+	//No file shipped, synthesize a short decaying blip in the device format
+	int frequency = MIX_DEFAULT_FREQUENCY;
+	Uint16 format = MIX_DEFAULT_FORMAT;
+	int channels = 2;
+	Mix_QuerySpec(&frequency, &format, &channels);
+	if (format != AUDIO_S16SYS)
+	{
+		printf("Warning: unable to load sound %s! SDL_mixer Error: %s\n", path, Mix_GetError());
+		return NULL;
+	}
+
+	double length = 0.08;
+	double pitch = 880.0;
+	double sweep = 0.0;
+	if (sound == SOUND_HIT)
+	{
+		length = 0.06;
+		pitch = 220.0;
+	}
+	else if (sound == SOUND_ENEMY_DEAD)
+	{
+		length = 0.3;
+		pitch = 440.0;
+		sweep = -300.0;
+	}
+
+	int frames = (int)(length * frequency);
+	std::vector<Sint16>& samples = mSynthBuffers[sound];
+	samples.resize((size_t)frames * channels);
+
+	double phase = 0.0;
+	Uint32 noise = 0x1234567;
+	for (int i = 0; i < frames; ++i)
+	{
+		double t = (double)i / frequency;
+		double envelope = 1.0 - (double)i / frames;
+		phase += (pitch + sweep * t) / frequency;
+
+		//Square wave, with some noise mixed in for the gunshot
+		double value = (phase - floor(phase)) < 0.5 ? 1.0 : -1.0;
+		if (sound == SOUND_SHOT)
+		{
+			noise = noise * 1664525 + 1013904223;
+			value = value * 0.3 + ((double)(noise >> 16) / 32768.0 - 1.0) * 0.7;
+		}
+
+		Sint16 sample = (Sint16)(value * envelope * envelope * 8000.0);
+		for (int c = 0; c < channels; ++c)
+		{
+			samples[(size_t)i * channels + c] = sample;
+		}
+	}
+
+	return Mix_QuickLoad_RAW((Uint8*)samples.data(), (Uint32)(samples.size() * sizeof(Sint16)));
+}
+
+void AudioEngine::close()
+{
+	mEnabled = false;
+	if (!mOpened)
+	{
+		return;
+	}
+
+	if (mThread != NULL)
+	{
+		mRunning = false;
+		SDL_SemPost(mSignal);
+		SDL_WaitThread(mThread, NULL);
+		mThread = NULL;
+	}
+	if (mSignal != NULL)
+	{
+		SDL_DestroySemaphore(mSignal);
+		mSignal = NULL;
+	}
+
+	Mix_HaltChannel(-1);
+	for (int i = 0; i < SOUND_TOTAL; ++i)
+	{
+		if (mChunks[i] != NULL)
+		{
+			Mix_FreeChunk(mChunks[i]);
+			mChunks[i] = NULL;
+		}
+		mSynthBuffers[i].clear();
+	}
+
+	Mix_CloseAudio();
+	SDL_QuitSubSystem(SDL_INIT_AUDIO);
+	mOpened = false;
+
+	printf("Audio: %d commands dropped, %d voices stolen\n", mDropped.load(), mStolen.load());
+}
+
+void AudioEngine::play(SoundId sound, int volume)
+{
+	if (!mEnabled)
+	{
+		return;
+	}
+
+	AudioCommand cmd = { CMD_PLAY, sound, volume };
+	if (!mQueue.push(cmd))
+	{
+		mDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	SDL_SemPost(mSignal);
+}
+
+void AudioEngine::stopAll()
+{
+	if (!mEnabled)
+	{
+		return;
+	}
+
+	AudioCommand cmd = { CMD_STOP_ALL, SOUND_SHOT, 0 };
+	if (!mQueue.push(cmd))
+	{
+		mDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	SDL_SemPost(mSignal);
+}
+
+int AudioEngine::audioThread(void* data)
+{
+	AudioEngine* engine = (AudioEngine*)data;
+	AudioCommand cmd;
+
+	while (engine->mRunning.load())
+	{
+		//Sleep until something is queued, then drain everything that is waiting
+		SDL_SemWait(engine->mSignal);
+		while (engine->mQueue.pop(cmd))
+		{
+			engine->execute(cmd);
+		}
+	}
+
+	return 0;
+}
+
+void AudioEngine::execute(const AudioCommand& cmd)
+{
+	if (cmd.type == CMD_STOP_ALL)
+	{
+		Mix_HaltChannel(-1);
+		return;
+	}
+
+	Mix_Chunk* chunk = mChunks[cmd.sound];
+	if (chunk == NULL)
+	{
+		return;
+	}
+
+	int channel = pickChannel(cmd.sound);
+	if (channel < 0)
+	{
+		mDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Mix_Volume(channel, cmd.volume);
+	if (Mix_PlayChannel(channel, chunk, 0) >= 0)
+	{
+		mChannelSound[channel] = cmd.sound;
+		mChannelStart[channel] = SDL_GetTicks();
+	}
+}
+
+int AudioEngine::pickChannel(SoundId sound)
+{
+	for (int i = 0; i < AUDIO_CHANNELS; ++i)
+	{
+		if (!Mix_Playing(i))
+		{
+			return i;
+		}
+	}
+
+	//Pool is full, steal the oldest voice that isn't more important, see SoundId for the order
+	int victim = -1;
+	for (int i = 0; i < AUDIO_CHANNELS; ++i)
+	{
+		if (mChannelSound[i] > sound)
+		{
+			continue;
+		}
+		if (victim < 0 || mChannelSound[i] < mChannelSound[victim] ||
+			(mChannelSound[i] == mChannelSound[victim] && mChannelStart[i] < mChannelStart[victim]))
+		{
+			victim = i;
+		}
+	}
+
+	if (victim >= 0)
+	{
+		Mix_HaltChannel(victim);
+		mStolen.fetch_add(1, std::memory_order_relaxed);
+	}
+	return victim;
+}
+
+const ParticleEmitter gEmitters[EMITTER_TOTAL] =
+{
+	//Muzzle flash: quick yellow burst in the firing direction
+	{ { 255, 220, 80, 255 }, 3.0f, 12, 2.0f, 6.0f, 0.5f, 10.0f, 0.0f },
+	//Hit: red sparks thrown back from the impact that fall
+	{ { 220, 30, 30, 255 }, 4.0f, 24, 1.0f, 7.0f, 1.2f, 30.0f, 0.35f }
+};
+
+ParticleSystem::ParticleSystem()
+{
+	mHighWater = 0;
+	mLiveCount = 0;
+	mSeed = 0x2545F491;
+	mStressTarget = 0;
+}
+
+void ParticleSystem::init()
+{
+	mPosX.resize(MAX_PARTICLES);
+	mPosY.resize(MAX_PARTICLES);
+	mVelX.resize(MAX_PARTICLES);
+	mVelY.resize(MAX_PARTICLES);
+	mAccY.resize(MAX_PARTICLES);
+	mLife.resize(MAX_PARTICLES);
+	mInvMaxLife.resize(MAX_PARTICLES);
+	mEmitter.resize(MAX_PARTICLES);
+	mAlive.resize(MAX_PARTICLES);
+	mFreeList.reserve(MAX_PARTICLES);
+
+	//The emitters' ranges never add up to more than every particle, render never has to grow it
+	mVertices.resize((size_t)MAX_PARTICLES * 4);
+
+	//Every quad uses the same two triangles, so build the indices once
+	mIndices.resize((size_t)MAX_PARTICLES * 6);
+	for (int i = 0; i < MAX_PARTICLES; ++i)
+	{
+		int base = i * 4;
+		int* idx = &mIndices[(size_t)i * 6];
+		idx[0] = base;
+		idx[1] = base + 1;
+		idx[2] = base + 2;
+		idx[3] = base + 2;
+		idx[4] = base + 3;
+		idx[5] = base;
+	}
+}
+
+float ParticleSystem::random()
+{
+	mSeed = mSeed * 1664525 + 1013904223;
+	return (mSeed >> 8) * (1.0f / 16777216.0f);
+}
+
+int ParticleSystem::allocate()
+{
+	if (!mFreeList.empty())
+	{
+		int index = mFreeList.back();
+		mFreeList.pop_back();
+		return index;
+	}
+
+	//Also stops emitting before init
+	if (mHighWater >= (int)mPosX.size())
+	{
+		return -1;
+	}
+
+	//Open up a new group of four, the spares go on the free list
+	int index = mHighWater;
+	mHighWater += 4;
+	for (int i = mHighWater - 1; i > index; --i)
+	{
+		mFreeList.push_back(i);
+	}
+	return index;
+}
+
+void ParticleSystem::emit(EmitterId emitter, float x, float y, float dirX)
+{
+	const ParticleEmitter& e = gEmitters[emitter];
+	float baseAngle = (dirX >= 0.0f) ? 0.0f : 3.14159265f;
+
+	for (int n = 0; n < e.burst; ++n)
+	{
+		int i = allocate();
+		if (i < 0)
+		{
+			return;
+		}
+
+		float angle = baseAngle + (random() * 2.0f - 1.0f) * e.spread;
+		float speed = e.minSpeed + random() * (e.maxSpeed - e.minSpeed);
+		float life = e.life * (0.5f + random() * 0.5f);
+
+		mPosX[i] = x;
+		mPosY[i] = y;
+		mVelX[i] = cosf(angle) * speed;
+		mVelY[i] = sinf(angle) * speed;
+		mAccY[i] = e.gravity;
+		mLife[i] = life;
+		mInvMaxLife[i] = 1.0f / life;
+		mEmitter[i] = (Uint8)emitter;
+		mAlive[i] = 1;
+		++mLiveCount;
+	}
+}
+
+void ParticleSystem::update()
+{
+	float* px = mPosX.data();
+	float* py = mPosY.data();
+	float* vx = mVelX.data();
+	float* vy = mVelY.data();
+	const float* ay = mAccY.data();
+	float* life = mLife.data();
+
+	//Integrate every used slot, dead slots just keep counting down harmlessly
+	int count = mHighWater;
+	int i = 0;
+#ifdef HAVE_SSE2
+	const __m128 drag = _mm_set1_ps(PARTICLE_DRAG);
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (; i < count; i += 4)
+	{
+		__m128 x = _mm_loadu_ps(px + i);
+		__m128 y = _mm_loadu_ps(py + i);
+		__m128 velX = _mm_loadu_ps(vx + i);
+		__m128 velY = _mm_loadu_ps(vy + i);
+
+		x = _mm_add_ps(x, velX);
+		y = _mm_add_ps(y, velY);
+		velX = _mm_mul_ps(velX, drag);
+		velY = _mm_add_ps(_mm_mul_ps(velY, drag), _mm_loadu_ps(ay + i));
+
+		_mm_storeu_ps(px + i, x);
+		_mm_storeu_ps(py + i, y);
+		_mm_storeu_ps(vx + i, velX);
+		_mm_storeu_ps(vy + i, velY);
+		_mm_storeu_ps(life + i, _mm_sub_ps(_mm_loadu_ps(life + i), one));
+	}
+#endif
+	for (; i < count; ++i)
+	{
+		px[i] += vx[i];
+		py[i] += vy[i];
+		vx[i] *= PARTICLE_DRAG;
+		vy[i] = vy[i] * PARTICLE_DRAG + ay[i];
+		life[i] -= 1.0f;
+	}
+
+	//Recycle particles that ran out this frame
+	for (i = 0; i < count; i += 4)
+	{
+#ifdef HAVE_SSE2
+		//Skip the whole group when nothing in it has expired
+		if (_mm_movemask_ps(_mm_cmple_ps(_mm_loadu_ps(life + i), _mm_setzero_ps())) == 0)
+		{
+			continue;
+		}
+#endif
+		for (int j = i; j < i + 4; ++j)
+		{
+			if (mAlive[j] && life[j] <= 0.0f)
+			{
+				mAlive[j] = 0;
+				mFreeList.push_back(j);
+				--mLiveCount;
+			}
+		}
+	}
+}
+
+void ParticleSystem::render(int camX, int camY)
+{
+	//Count each emitter's particles so their ranges can sit back to back in the one batch
+	int counts[EMITTER_TOTAL] = {};
+	for (int i = 0; i < mHighWater; ++i)
+	{
+		if (mAlive[i])
+		{
+			++counts[mEmitter[i]];
+		}
+	}
+
+	//Write straight into the presized batch, one cursor per emitter range
+	SDL_Vertex* start[EMITTER_TOTAL];
+	SDL_Vertex* cursor[EMITTER_TOTAL];
+	SDL_Vertex* next = mVertices.data();
+	for (int e = 0; e < EMITTER_TOTAL; ++e)
+	{
+		start[e] = next;
+		cursor[e] = next;
+		next += (size_t)counts[e] * 4;
+	}
+
+	const float* px = mPosX.data();
+	const float* py = mPosY.data();
+	const float* life = mLife.data();
+	const float* invMaxLife = mInvMaxLife.data();
+	for (int i = 0; i < mHighWater; ++i)
+	{
+		if (!mAlive[i])
+		{
+			continue;
+		}
+
+		const ParticleEmitter& e = gEmitters[mEmitter[i]];
+		float half = e.size * 0.5f;
+		float left = px[i] - camX - half;
+		float top = py[i] - camY - half;
+		float right = left + e.size;
+		float bottom = top + e.size;
+
+		//Fade out over the particle's life
+		SDL_Color color = e.color;
+		color.a = (Uint8)(255.0f * life[i] * invMaxLife[i]);
+
+		SDL_Vertex* v = cursor[mEmitter[i]];
+		v[0].position.x = left; v[0].position.y = top;
+		v[1].position.x = right; v[1].position.y = top;
+		v[2].position.x = right; v[2].position.y = bottom;
+		v[3].position.x = left; v[3].position.y = bottom;
+		for (int k = 0; k < 4; ++k)
+		{
+			v[k].color = color;
+			v[k].tex_coord.x = 0.0f;
+			v[k].tex_coord.y = 0.0f;
+		}
+		cursor[mEmitter[i]] = v + 4;
+	}
+
+	SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_BLEND);
+	for (int e = 0; e < EMITTER_TOTAL; ++e)
+	{
+		int vertexCount = counts[e] * 4;
+		if (vertexCount > 0)
+		{
+			SDL_RenderGeometry(gRenderer, NULL, start[e], vertexCount, mIndices.data(), counts[e] * 6);
+		}
+	}
+	SDL_SetRenderDrawBlendMode(gRenderer, SDL_BLENDMODE_NONE);
+}
+
+void ParticleSystem::setStressTarget(int liveParticles)
+{
+	mStressTarget = liveParticles < MAX_PARTICLES ? liveParticles : MAX_PARTICLES;
+}
+
+void ParticleSystem::emitStress(const SDL_Rect& view)
+{
+	//Nothing to fill before init
+	if (mPosX.empty())
+	{
+		return;
+	}
+
+	//Alternate emitters at random points in view, the target never exceeds the pool
+	int emitter = 0;
+	while (mLiveCount < mStressTarget)
+	{
+		float x = view.x + random() * view.w;
+		float y = view.y + random() * view.h;
+		emit((EmitterId)emitter, x, y, random() < 0.5f ? -1.0f : 1.0f);
+		emitter = (emitter + 1) % EMITTER_TOTAL;
+	}
+}
+
+void ParticleSystem::clear()
+{
+	for (int i = 0; i < mHighWater; ++i)
+	{
+		mAlive[i] = 0;
+	}
+	mFreeList.clear();
+	mHighWater = 0;
+	mLiveCount = 0;
+}
+
+ThemeCache::ThemeCache()
+{
+	mCurrent = THEME_BRIGHT;
+	mDecodes = 0;
+	mHits = 0;
+	mEvicted = 0;
+	mEvictedBytes = 0;
+}
+
+ThemeCache::~ThemeCache()
+{
+	free();
+}
+
+LTexture* ThemeCache::get(const std::string& path, Theme theme)
+{
+	mCurrent = theme;
+
+	for (size_t i = 0; i < mEntries.size(); ++i)
+	{
+		if (mEntries[i].theme == theme && mEntries[i].path == path)
+		{
+			++mHits;
+			return mEntries[i].texture;
+		}
+	}
+
+	SDL_Surface* surface = IMG_Load(path.c_str());
+	if (surface == NULL)
+	{
+		printf("Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
+		return NULL;
+	}
+	++mDecodes;
+
+	//Recolour in place, the decoded image isn't kept once the texture is up
+	std::string asset = path;
+	if (theme != THEME_BRIGHT)
+	{
+		surface = applyPaletteVariant(surface, theme);
+		asset += std::string("#") + gPaletteVariants[theme].name;
+	}
+
+	LTexture* texture = new LTexture();
+	bool loaded = texture->loadFromSurface(surface, asset);
+	SDL_FreeSurface(surface);
+
+	if (!loaded)
+	{
+		delete texture;
+		return NULL;
+	}
+
+	Entry entry = { path, theme, texture };
+	mEntries.push_back(entry);
+	return texture;
+}
+
+void ThemeCache::trim()
+{
+	for (size_t i = 0; i < mEntries.size();)
+	{
+		if (mEntries[i].theme != mCurrent)
+		{
+			++mEvicted;
+			mEvictedBytes += mEntries[i].texture->getBytes();
+			delete mEntries[i].texture;
+			mEntries[i] = mEntries.back();
+			mEntries.pop_back();
+		}
+		else
+		{
+			++i;
+		}
+	}
+}
+
+void ThemeCache::free()
+{
+	for (size_t i = 0; i < mEntries.size(); ++i)
+	{
+		delete mEntries[i].texture;
+	}
+	mEntries.clear();
+}
+
+void ThemeCache::printReport()
+{
+	long long resident = 0;
+	for (size_t i = 0; i < mEntries.size(); ++i)
+	{
+		resident += mEntries[i].texture->getBytes();
+	}
+
+	printf("Theme cache: %d textures resident (%lld KB), %d evicted (%lld KB freed), %d decodes, %d lookups served from the cache\n",
+		(int)mEntries.size(), resident / 1024, mEvicted, mEvictedBytes / 1024, mDecodes, mHits);
+}
+
+void AnimationSet::defineClip(AnimClip clip, const SDL_Rect* frames, int frameCount, bool loop, AnimClip next)
+{
+	Clip& c = mClips[clip];
+	c.cellWidth = 0;
+	c.loop = loop;
+	c.next = next;
+	setFrames(c, frames, frameCount);
+}
+
+void AnimationSet::defineGridClip(AnimClip clip, int cellWidth, bool loop, AnimClip next)
+{
+	//No frames until the sheet is read, the clip counts as played out until then
+	Clip& c = mClips[clip];
+	c.cellWidth = cellWidth;
+	c.loop = loop;
+	c.next = next;
+	setFrames(c, NULL, 0);
+}
+
+void AnimationSet::setFrames(Clip& c, const SDL_Rect* frames, int frameCount)
+{
+	c.frames.assign(frames, frames + frameCount);
+
+	//Rendering only has to index this by the clip time
+	c.timeline.resize((size_t)frameCount * TICKS_PER_FRAME);
+	for (size_t t = 0; t < c.timeline.size(); ++t)
+	{
+		c.timeline[t] = (Uint8)(t / TICKS_PER_FRAME);
+	}
+}
+
+void AnimationSet::start(AnimState& state, AnimClip clip, int time)
+{
+	int length = (int)mClips[clip].timeline.size();
+	state.clip = (Uint8)clip;
+	state.finished = 0;
+	state.time = (Uint16)(length > 0 ? time % length : 0);
+}
+
+void AnimationSet::play(AnimState& state, AnimClip clip)
+{
+	if (state.clip == clip && mClips[clip].loop)
+	{
+		return;
+	}
+	start(state, clip);
+}
+
+void AnimationSet::advance(AnimState& state)
+{
+	const Clip& c = mClips[state.clip];
+	if (c.timeline.empty())
+	{
+		//A clip whose sheet failed to load counts as played out
+		state.finished = 1;
+		return;
+	}
+	if (state.finished)
+	{
+		return;
+	}
+
+	if (state.time + 1u < c.timeline.size())
+	{
+		++state.time;
+	}
+	else if (c.loop)
+	{
+		state.time = 0;
+	}
+	else if (c.next != state.clip)
+	{
+		start(state, c.next);
+	}
+	else
+	{
+		state.finished = 1;
+	}
+}
+
+void AnimationSet::render(const AnimState& state, int x, int y, SDL_RendererFlip flip)
+{
+	const Clip& c = mClips[state.clip];
+	if (c.sheet == NULL || c.timeline.empty())
+	{
+		return;
+	}
+
+	SDL_Rect frame = c.frames[c.timeline[state.time]];
+	c.sheet->render(x, y, &frame, 0.0, NULL, flip);
+}
+
+//Widens bounds to cover box, empty boxes are skipped and an empty bounds takes box as it is
+void growBounds(SDL_Rect& bounds, const SDL_Rect& box)
+{
+	if (box.w == 0)
+	{
+		return;
+	}
+	if (bounds.w == 0)
+	{
+		bounds = box;
+		return;
+	}
+
+	int right = bounds.x + bounds.w > box.x + box.w ? bounds.x + bounds.w : box.x + box.w;
+	int bottom = bounds.y + bounds.h > box.y + box.h ? bounds.y + bounds.h : box.y + box.h;
+	bounds.x = bounds.x < box.x ? bounds.x : box.x;
+	bounds.y = bounds.y < box.y ? bounds.y : box.y;
+	bounds.w = right - bounds.x;
+	bounds.h = bottom - bounds.y;
+}
+
+bool AnimationSet::loadSheet(AnimClip clip, const std::string& path)
+{
+	Clip& c = mClips[clip];
+	c.masks.clear();
+
+	//Read apart from any texture, so the simulation has its clips without a renderer
+	SDL_Surface* loadedSurface = IMG_Load(path.c_str());
+	if (loadedSurface == NULL)
+	{
+		printf("Unable to load %s for animation! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
+		return false;
+	}
+
+	SDL_Surface* surface = SDL_ConvertSurfaceFormat(loadedSurface, SDL_PIXELFORMAT_ARGB8888, 0);
+	SDL_FreeSurface(loadedSurface);
+	if (surface == NULL)
+	{
+		printf("Unable to convert %s for collision masks! SDL Error: %s\n", path.c_str(), SDL_GetError());
+		return false;
+	}
+
+	if (c.cellWidth > 0)
+	{
+		//Same frame box as the hand-placed clips, centred in each cell
+		std::vector<SDL_Rect> frames;
+		for (int x = 0; x + c.cellWidth <= surface->w; x += c.cellWidth)
+		{
+			SDL_Rect frame = { x + (c.cellWidth - 100) / 2, 0, 100, 155 };
+			frames.push_back(frame);
+		}
+		setFrames(c, frames.data(), (int)frames.size());
+	}
+
+	//Clip boxes can hang off the sheet, SDL draws the part on the sheet stretched over the whole box
+	SDL_Rect sheetArea = { 0, 0, surface->w, surface->h };
+	c.masks.resize(c.frames.size() * 2);
+	SDL_LockSurface(surface);
+	for (size_t i = 0; i < c.frames.size(); ++i)
+	{
+		SDL_Rect source;
+		if (SDL_IntersectRect(&c.frames[i], &sheetArea, &source))
+		{
+			c.masks[i * 2].build(surface, source, c.frames[i].w, c.frames[i].h, false);
+			c.masks[i * 2 + 1].build(surface, source, c.frames[i].w, c.frames[i].h, true);
+		}
+	}
+	SDL_UnlockSurface(surface);
+	SDL_FreeSurface(surface);
+
+	//Until shareBounds widens it, the clip's own masks
+	c.bounds.x = c.bounds.y = c.bounds.w = c.bounds.h = 0;
+	for (size_t i = 0; i < c.masks.size(); ++i)
+	{
+		growBounds(c.bounds, c.masks[i].getBounds());
+	}
+	return true;
+}
+
+void AnimationSet::shareBounds(AnimClip first, AnimClip last)
+{
+	SDL_Rect shared = { 0, 0, 0, 0 };
+	for (int clip = first; clip <= last; ++clip)
+	{
+		growBounds(shared, mClips[clip].bounds);
+	}
+
+	for (int clip = first; clip <= last; ++clip)
+	{
+		if (mClips[clip].bounds.w > 0)
+		{
+			mClips[clip].bounds = shared;
+		}
+	}
+}
+
+const SDL_Rect* AnimationSet::getBounds(const AnimState& state) const
+{
+	const Clip& c = mClips[state.clip];
+	return c.bounds.w > 0 ? &c.bounds : NULL;
+}
+
+const CollisionMask* AnimationSet::getMask(const AnimState& state, SDL_RendererFlip flip) const
+{
+	const Clip& c = mClips[state.clip];
+	if (c.masks.empty() || c.timeline.empty())
+	{
+		return NULL;
+	}
+
+	const CollisionMask& mask = c.masks[c.timeline[state.time] * 2 + (flip == SDL_FLIP_HORIZONTAL ? 1 : 0)];
+	return mask.isEmpty() ? NULL : &mask;
+}
+
+CollisionMask::CollisionMask()
+{
+	mHeight = 0;
+	mBounds.x = 0;
+	mBounds.y = 0;
+	mBounds.w = 0;
+	mBounds.h = 0;
+}
+
+void CollisionMask::build(SDL_Surface* surface, const SDL_Rect& source, int width, int height, bool mirrored)
+{
+	int columns = width < MAX_WIDTH ? width : MAX_WIDTH;
+	mHeight = height;
+	mRows.assign((size_t)mHeight * ROW_WORDS, 0);
+
+	int left = MAX_WIDTH, right = -1, top = mHeight, bottom = -1;
+	for (int y = 0; y < mHeight; ++y)
+	{
+		//Each drawn pixel samples the source at its centre
+		int sheetY = source.y + (2 * y + 1) * source.h / (2 * height);
+		if (sheetY < 0 || sheetY >= surface->h)
+		{
+			continue;
+		}
+
+		const Uint32* row = (const Uint32*)((const Uint8*)surface->pixels + sheetY * surface->pitch);
+		Uint64* bits = &mRows[(size_t)y * ROW_WORDS];
+		for (int x = 0; x < columns; ++x)
+		{
+			int drawnX = mirrored ? width - 1 - x : x;
+			int sheetX = source.x + (2 * drawnX + 1) * source.w / (2 * width);
+			if (sheetX < 0 || sheetX >= surface->w)
+			{
+				continue;
+			}
+
+			//Solid unless see-through or the cyan colour key
+			Uint32 pixel = row[sheetX];
+			if ((pixel >> 24) < ALPHA_THRESHOLD || (pixel & 0xFFFFFF) == 0x00FFFF)
+			{
+				continue;
+			}
+
+			bits[x / 64] |= (Uint64)1 << (x % 64);
+			left = x < left ? x : left;
+			right = x > right ? x : right;
+			top = y < top ? y : top;
+			bottom = y > bottom ? y : bottom;
+		}
+	}
+
+	if (right < 0)
+	{
+		mBounds.x = mBounds.y = mBounds.w = mBounds.h = 0;
+		return;
+	}
+	mBounds.x = left;
+	mBounds.y = top;
+	mBounds.w = right - left + 1;
+	mBounds.h = bottom - top + 1;
+}
+
+bool CollisionMask::overlaps(int x, int y, const CollisionMask& other, int otherX, int otherY) const
+{
+	//Rows both masks cover
+	int firstY = y > otherY ? y : otherY;
+	int lastY = (y + mHeight < otherY + other.mHeight ? y + mHeight : otherY + other.mHeight) - 1;
+
+	//Other's rows are shifted into this mask's columns
+	int shift = otherX - x;
+	if (firstY > lastY || shift >= MAX_WIDTH || shift <= -MAX_WIDTH)
+	{
+		return false;
+	}
+
+#ifdef HAVE_SSE2
+	//A whole row is one register, shifted across both words at once
+	__m128i any = _mm_setzero_si128();
+	int wordShift = (shift < 0 ? -shift : shift) >= 64;
+	int bitShift = (shift < 0 ? -shift : shift) % 64;
+	__m128i count = _mm_cvtsi32_si128(bitShift);
+	__m128i carry = _mm_cvtsi32_si128(64 - bitShift);
+	for (int row = firstY; row <= lastY; ++row)
+	{
+		__m128i mine = _mm_loadu_si128((const __m128i*)&mRows[(size_t)(row - y) * ROW_WORDS]);
+		__m128i theirs = _mm_loadu_si128((const __m128i*)&other.mRows[(size_t)(row - otherY) * ROW_WORDS]);
+		if (shift >= 0)
+		{
+			theirs = wordShift ? _mm_slli_si128(theirs, 8) : theirs;
+			theirs = _mm_or_si128(_mm_sll_epi64(theirs, count), _mm_srl_epi64(_mm_slli_si128(theirs, 8), carry));
+		}
+		else
+		{
+			theirs = wordShift ? _mm_srli_si128(theirs, 8) : theirs;
+			theirs = _mm_or_si128(_mm_srl_epi64(theirs, count), _mm_sll_epi64(_mm_srli_si128(theirs, 8), carry));
+		}
+		any = _mm_or_si128(any, _mm_and_si128(mine, theirs));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+#else
+	Uint64 any = 0;
+	for (int row = firstY; row <= lastY; ++row)
+	{
+		const Uint64* mine = &mRows[(size_t)(row - y) * ROW_WORDS];
+		const Uint64* theirs = &other.mRows[(size_t)(row - otherY) * ROW_WORDS];
+
+		//Shift the two words as one 128-bit row
+		Uint64 low = theirs[0], high = theirs[1];
+		if (shift >= 64)
+		{
+			high = low << (shift - 64);
+			low = 0;
+		}
+		else if (shift > 0)
+		{
+			high = (high << shift) | (low >> (64 - shift));
+			low <<= shift;
+		}
+		else if (shift <= -64)
+		{
+			low = high >> (-shift - 64);
+			high = 0;
+		}
+		else if (shift < 0)
+		{
+			low = (low >> -shift) | (high << (64 + shift));
+			high >>= -shift;
+		}
+		any |= (mine[0] & low) | (mine[1] & high);
+	}
+	return any != 0;
+#endif
+}
+
+bool CollisionMask::overlapsRect(int x, int y, SDL_Rect box) const
+{
+	//The box in this mask's columns and rows, clipped to it
+	int left = box.x - x < 0 ? 0 : box.x - x;
+	int right = box.x + box.w - x > MAX_WIDTH ? MAX_WIDTH : box.x + box.w - x;
+	int top = box.y - y < 0 ? 0 : box.y - y;
+	int bottom = box.y + box.h - y > mHeight ? mHeight : box.y + box.h - y;
+	if (left >= right || top >= bottom)
+	{
+		return false;
+	}
+
+	//Bits for the box's columns, the same for every row
+	Uint64 columns[ROW_WORDS];
+	for (int word = 0; word < ROW_WORDS; ++word)
+	{
+		int from = left - word * 64 < 0 ? 0 : left - word * 64;
+		int to = right - word * 64 > 64 ? 64 : right - word * 64;
+		if (from >= to)
+		{
+			columns[word] = 0;
+		}
+		else
+		{
+			Uint64 upTo = to == 64 ? ~(Uint64)0 : ((Uint64)1 << to) - 1;
+			columns[word] = upTo & ~(((Uint64)1 << from) - 1);
+		}
+	}
+
+	Uint64 any = 0;
+	for (int row = top; row < bottom; ++row)
+	{
+		const Uint64* bits = &mRows[(size_t)row * ROW_WORDS];
+		any |= (bits[0] & columns[0]) | (bits[1] & columns[1]);
+	}
+	return any != 0;
+}
+
+Dot::Dot()
+{
+	//Initialize the offsets
+	mPosX = 30;
+	mPosY = 800;
+
+	//Initialize the velocity
+	mVelX = 0;
+	mVelY = 0;
+	mHeldLeft = false;
+	mHeldRight = false;
+	mState = IDLE;
+
+	mHealth = 100;
+	lastDamageFrame = 0;
+	mFlipType = SDL_FLIP_NONE;
+	gAnimations.start(mAnim, CLIP_IDLE);
+}
+Enemy::Enemy(int x, int y)
+{
+	mPosX = x;
+	mPosY = y;
+
+	mVelX = 0;
+	mVelY = 0;
+	health = ENEMY_MAX_HEALTH;
+	gAnimations.start(mAnim, CLIP_ENEMY_IDLE);
+}
+
+void Enemy::spawn(int x, int y)
+{
+	mPosX = x;
+	mPosY = y;
+
+	mVelX = 0;
+	mVelY = 0;
+	health = ENEMY_MAX_HEALTH;
+
+	//Start somewhere in the idle loop so a wave doesn't animate in lockstep
+	gAnimations.start(mAnim, CLIP_ENEMY_IDLE, (x * 7 + y * 13) & 0xFF);
+}
+
+WaveSpawner::WaveSpawner()
+{
+	mPool.assign(MAX_ENEMIES, Enemy(0, 0));
+	mFreeList.reserve(MAX_ENEMIES);
+	mActive.reserve(MAX_ENEMIES);
+	mVisited.assign(MAX_ENEMIES, 0);
+	mQuery = 0;
+	mGridColumns = 0;
+	mGridRows = 0;
+
+	//Hand out low indices first
+	for (int i = MAX_ENEMIES - 1; i >= 0; --i)
+	{
+		mFreeList.push_back(i);
+	}
+
+	mNextWave = 0;
+	mFrame = 0;
+	mPeak = 0;
+	mDropped = 0;
+
+	//Default level: the single street thug
+	Wave first = { 0, 1, 900, 800, 0 };
+	mSchedule.push_back(first);
+}
+
+void WaveSpawner::setStressSchedule(int targetEnemies)
+{
+	if (targetEnemies > MAX_ENEMIES)
+	{
+		printf("Warning: stress target %d is over the pool size, capping at %d\n", targetEnemies, MAX_ENEMIES);
+		targetEnemies = MAX_ENEMIES;
+	}
+
+	mSchedule.clear();
+	mNextWave = 0;
+
+	//A new wave every second, each twice the last, until the target is reached
+	int total = 0;
+	int waveSize = 1;
+	int startFrame = 0;
+	while (total < targetEnemies)
+	{
+		int count = waveSize;
+		if (total + count > targetEnemies)
+		{
+			count = targetEnemies - total;
+		}
+
+		//Start clear of the dot's spawn point so the player isn't boxed in
+		Wave wave = { startFrame, count, 200, (int)mSchedule.size() * 40 % 400, 25 };
+		mSchedule.push_back(wave);
+
+		total += count;
+		waveSize *= 2;
+		startFrame += 60;
+	}
+}
+
+bool WaveSpawner::spawnEnemy(int x, int y)
+{
+	if (mFreeList.empty())
+	{
+		++mDropped;
+		return false;
+	}
+
+	int index = mFreeList.back();
+	mFreeList.pop_back();
+
+	mPool[index].spawn(x, y);
+	mActive.push_back(index);
+	return true;
+}
+
+void WaveSpawner::update(const SimContext& sim)
+{
+	//Rows are spaced by the collider drawn from the idle clip, the fixed box when its sheet is missing
+	AnimState idle = { CLIP_ENEMY_IDLE, 0, 0 };
+	const SDL_Rect* bounds = gAnimations.getBounds(idle);
+	SDL_Rect box = { 0, 70, Enemy::ENEMY_WIDTH, Enemy::ENEMY_HEIGHT };
+	if (bounds != NULL)
+	{
+		box = *bounds;
+	}
+
+	//Spawn every wave that is due
+	while (mNextWave < mSchedule.size() && mSchedule[mNextWave].startFrame <= mFrame)
+	{
+		const Wave& wave = mSchedule[mNextWave];
+		int x = wave.spawnX;
+		int y = wave.spawnY;
+		for (int i = 0; i < wave.count; ++i)
+		{
+			spawnEnemy(x, y);
+
+			//Wrap onto the next row at the edge of the level, and back to the top at the bottom
+			x += wave.spacing;
+			if (x + box.x + box.w > sim.levelWidth)
+			{
+				x = wave.spawnX;
+				y += box.h;
+				if (y + box.y + box.h > LEVEL_HEIGHT)
+				{
+					y = 0;
+				}
+			}
+		}
+		++mNextWave;
+	}
+	++mFrame;
+
+	if ((int)mActive.size() > mPeak)
+	{
+		mPeak = (int)mActive.size();
+	}
+
+	//Animations for every enemy in one pass
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		gAnimations.advance(mPool[mActive[i]].getAnimation());
+	}
+
+	//Move the living, hand the dead back to the pool once they have finished falling
+	for (size_t i = 0; i < mActive.size();)
+	{
+		Enemy& enemy = mPool[mActive[i]];
+		if (enemy.isDead() && gAnimations.isFinished(enemy.getAnimation()))
+		{
+			mFreeList.push_back(mActive[i]);
+			mActive[i] = mActive.back();
+			mActive.pop_back();
+		}
+		else
+		{
+			if (!enemy.isDead())
+			{
+				enemy.move();
+			}
+			++i;
+		}
+	}
+
+	//Everything has moved, file the enemies for this tick's collision queries
+	buildGrid(sim.levelWidth);
+}
+
+void WaveSpawner::getCellRange(const SDL_Rect& box, int& firstColumn, int& firstRow, int& lastColumn, int& lastRow) const
+{
+	//Floor division so boxes hanging off the top or left edge land in the first cell
+	firstColumn = (box.x >= 0 ? box.x : box.x - GRID_CELL + 1) / GRID_CELL;
+	firstRow = (box.y >= 0 ? box.y : box.y - GRID_CELL + 1) / GRID_CELL;
+	lastColumn = (box.x + box.w - 1) / GRID_CELL;
+	lastRow = (box.y + box.h - 1) / GRID_CELL;
+
+	firstColumn = firstColumn < 0 ? 0 : (firstColumn >= mGridColumns ? mGridColumns - 1 : firstColumn);
+	firstRow = firstRow < 0 ? 0 : (firstRow >= mGridRows ? mGridRows - 1 : firstRow);
+	lastColumn = lastColumn < 0 ? 0 : (lastColumn >= mGridColumns ? mGridColumns - 1 : lastColumn);
+	lastRow = lastRow < 0 ? 0 : (lastRow >= mGridRows ? mGridRows - 1 : lastRow);
+}
+
+void WaveSpawner::buildGrid(int levelWidth)
+{
+	mGridColumns = (levelWidth + GRID_CELL - 1) / GRID_CELL;
+	mGridRows = (LEVEL_HEIGHT + GRID_CELL - 1) / GRID_CELL;
+	int cells = mGridColumns * mGridRows;
+
+	//Count each cell's enemies, anything off the level is filed in the nearest edge cell
+	mCellStart.assign(cells + 1, 0);
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		Enemy& enemy = mPool[mActive[i]];
+		if (enemy.isDead())
+		{
+			continue;
+		}
+
+		int firstColumn, firstRow, lastColumn, lastRow;
+		getCellRange(enemy.getCollider(), firstColumn, firstRow, lastColumn, lastRow);
+		for (int row = firstRow; row <= lastRow; ++row)
+		{
+			for (int column = firstColumn; column <= lastColumn; ++column)
+			{
+				++mCellStart[row * mGridColumns + column + 1];
+			}
+		}
+	}
+	for (int c = 0; c < cells; ++c)
+	{
+		mCellStart[c + 1] += mCellStart[c];
+	}
+
+	//Then drop them into their runs
+	mCellFill.assign(mCellStart.begin(), mCellStart.end() - 1);
+	mCellEnemies.resize(mCellStart[cells]);
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		Enemy& enemy = mPool[mActive[i]];
+		if (enemy.isDead())
+		{
+			continue;
+		}
+
+		int firstColumn, firstRow, lastColumn, lastRow;
+		getCellRange(enemy.getCollider(), firstColumn, firstRow, lastColumn, lastRow);
+		for (int row = firstRow; row <= lastRow; ++row)
+		{
+			for (int column = firstColumn; column <= lastColumn; ++column)
+			{
+				mCellEnemies[mCellFill[row * mGridColumns + column]++] = mActive[i];
+			}
+		}
+	}
+}
+
+void WaveSpawner::render(int camX, int camY)
+{
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		mPool[mActive[i]].render(camX, camY);
+	}
+}
+
+Enemy* WaveSpawner::findCollision(SDL_Rect box)
+{
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		Enemy& enemy = mPool[mActive[i]];
+		if (!enemy.isDead() && checkCollision(box, enemy.getCollider()))
+		{
+			return &enemy;
+		}
+	}
+	return NULL;
+}
+
+void WaveSpawner::saveState(std::vector<Uint8>& out) const
+{
+	int counts[6] = { (int)mActive.size(), (int)mFreeList.size(), (int)mNextWave, mFrame, mPeak, mDropped };
+	snapshotWrite(out, counts, sizeof(counts));
+	snapshotWrite(out, mFreeList.data(), mFreeList.size() * sizeof(int));
+	snapshotWrite(out, mActive.data(), mActive.size() * sizeof(int));
+
+	//Only live enemies need saving, pooled ones are reset on spawn
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		snapshotWrite(out, &mPool[mActive[i]], sizeof(Enemy));
+	}
+}
+
+void WaveSpawner::loadState(const Uint8*& in)
+{
+	int counts[6];
+	snapshotRead(in, counts, sizeof(counts));
+	mActive.resize(counts[0]);
+	mFreeList.resize(counts[1]);
+	mNextWave = counts[2];
+	mFrame = counts[3];
+	mPeak = counts[4];
+	mDropped = counts[5];
+
+	snapshotRead(in, mFreeList.data(), mFreeList.size() * sizeof(int));
+	snapshotRead(in, mActive.data(), mActive.size() * sizeof(int));
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		snapshotRead(in, &mPool[mActive[i]], sizeof(Enemy));
+	}
+}
+
+void WaveSpawner::copyActive(std::vector<Enemy>& out) const
+{
+	out.clear();
+	for (size_t i = 0; i < mActive.size(); ++i)
+	{
+		out.push_back(mPool[mActive[i]]);
+	}
+}
+
+SnapshotRing::SnapshotRing()
+{
+	mHead = 0;
+	mCount = 0;
+	mLastSaveMicros = 0.0;
+	mLastRestoreMicros = 0.0;
+	mLastSize = 0;
+}
+
+void SnapshotRing::save(const SimContext& sim, const Dot& dot, const WaveSpawner& waves)
+{
+	static_assert(std::is_trivially_copyable<Dot>::value, "Dot is saved as raw bytes");
+	static_assert(std::is_trivially_copyable<Enemy>::value, "Enemy is saved as raw bytes");
+	static_assert(std::is_trivially_copyable<Projectile>::value, "Projectile is saved as raw bytes");
+
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	std::vector<Uint8>& out = mFrames[mHead];
+	out.clear();
+
+	//Sized for the worst case, a full enemy pool plus a screenful of bullets, the first time the slot is used
+	//A simulation that never records never pays for the ring
+	if (out.capacity() == 0)
+	{
+		out.reserve(sizeof(Uint32) + sizeof(Dot) + sizeof(int) * 6
+			+ WaveSpawner::MAX_ENEMIES * (sizeof(int) + sizeof(Enemy))
+			+ sizeof(int) + 256 * sizeof(Projectile));
+	}
+
+	snapshotWrite(out, &sim.frame, sizeof(sim.frame));
+	snapshotWrite(out, &dot, sizeof(Dot));
+	waves.saveState(out);
+
+	int projectileCount = (int)sim.projectiles.size();
+	snapshotWrite(out, &projectileCount, sizeof(projectileCount));
+	snapshotWrite(out, sim.projectiles.data(), sim.projectiles.size() * sizeof(Projectile));
+
+	mHead = (mHead + 1) % SNAPSHOT_FRAMES;
+	if (mCount < SNAPSHOT_FRAMES)
+	{
+		++mCount;
+	}
+
+	mLastSize = (int)out.size();
+	mLastSaveMicros = (SDL_GetPerformanceCounter() - start) * 1000000.0 / SDL_GetPerformanceFrequency();
+}
+
+bool SnapshotRing::restore(int framesBack, SimContext& sim, Dot& dot, WaveSpawner& waves)
+{
+	if (framesBack < 1 || framesBack > mCount)
+	{
+		return false;
+	}
+
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	int slot = (mHead - framesBack + SNAPSHOT_FRAMES) % SNAPSHOT_FRAMES;
+	const Uint8* in = mFrames[slot].data();
+
+	snapshotRead(in, &sim.frame, sizeof(sim.frame));
+	//Held keys come back as they were then, the caller resyncs them with the keyboard
+	snapshotRead(in, &dot, sizeof(Dot));
+	waves.loadState(in);
+
+	int projectileCount = 0;
+	snapshotRead(in, &projectileCount, sizeof(projectileCount));
+	sim.projectiles.resize(projectileCount, Projectile(0, 0, 1));
+	snapshotRead(in, sim.projectiles.data(), projectileCount * sizeof(Projectile));
+
+	//Frames after the restored one no longer happened, and the restored
+	//frame itself is saved again when it is simulated
+	mHead = slot;
+	mCount -= framesBack;
+
+	mLastRestoreMicros = (SDL_GetPerformanceCounter() - start) * 1000000.0 / SDL_GetPerformanceFrequency();
+	return true;
+}
+
+ChunkedLevel::ChunkedLevel()
+{
+	mTileset = NULL;
+	mTileSize = 0;
+	mChunkTilesX = 0;
+	mChunkTilesY = 0;
+	mChunkCount = 0;
+	mSignal = NULL;
+	mThread = NULL;
+	mRunning = false;
+
+	for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+	{
+		mSlotState[i] = SLOT_FREE;
+		mSlotChunk[i] = -1;
+	}
+
+	mVersion = 0;
+	mLoads = 0;
+	mFailedLoads = 0;
+	mEvictions = 0;
+	mTotalLoadMs = 0.0;
+	mMaxLoadMs = 0.0;
+}
+
+ChunkedLevel::~ChunkedLevel()
+{
+	close();
+}
+
+bool ChunkedLevel::readHeader(std::string path)
+{
+	std::ifstream file(path.c_str(), std::ios::binary);
+	if (!file)
+	{
+		printf("Unable to open level %s!\n", path.c_str());
+		return false;
+	}
+
+	//Header lines come first, then each chunk starts with "chunk <index>"
+	std::string line;
+	bool success = true;
+	mChunkOffsets.clear();
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+		std::string key;
+		if (!(fields >> key) || key[0] == '#')
+		{
+			continue;
+		}
+
+		if (key == "tileset")
+		{
+			fields >> mTilesetPath;
+		}
+		else if (key == "tilesize")
+		{
+			fields >> mTileSize;
+		}
+		else if (key == "chunksize")
+		{
+			fields >> mChunkTilesX >> mChunkTilesY;
+		}
+		else if (key == "chunks")
+		{
+			fields >> mChunkCount;
+			mChunkOffsets.assign(mChunkCount > 0 ? mChunkCount : 0, -1);
+		}
+		else if (key == "chunk")
+		{
+			int index = -1;
+			fields >> index;
+			if (index < 0 || index >= (int)mChunkOffsets.size())
+			{
+				printf("Level %s has chunk %d outside its chunk count!\n", path.c_str(), index);
+				success = false;
+				break;
+			}
+			mChunkOffsets[index] = file.tellg();
+		}
+	}
+
+	if (success && (mTileSize <= 0 || mChunkTilesX <= 0 || mChunkTilesY <= 0 || mChunkCount <= 0))
+	{
+		printf("Level %s is missing its tileset, tilesize, chunksize or chunks line!\n", path.c_str());
+		success = false;
+	}
+	for (int i = 0; success && i < mChunkCount; ++i)
+	{
+		if (mChunkOffsets[i] < 0)
+		{
+			printf("Level %s is missing chunk %d!\n", path.c_str(), i);
+			success = false;
+		}
+	}
+	return success;
+}
+
+int ChunkedLevel::readWidth(std::string path)
+{
+	ChunkedLevel level;
+	if (!level.readHeader(path))
+	{
+		return LEVEL_WIDTH;
+	}
+	return level.mChunkCount * level.mChunkTilesX * level.mTileSize;
+}
+
+bool ChunkedLevel::open(std::string path)
+{
+	close();
+
+	if (!readHeader(path))
+	{
+		return false;
+	}
+
+	if (mChunkTilesY * mTileSize != LEVEL_HEIGHT)
+	{
+		printf("Warning: level %s is %d pixels tall, expected %d\n", path.c_str(), mChunkTilesY * mTileSize, LEVEL_HEIGHT);
+	}
+
+	mPath = path;
+	reloadTileset();
+	if (mTileset == NULL)
+	{
+		return false;
+	}
+
+	//All chunk memory is allocated here, streaming only reuses it
+	mChunkSlot.assign(mChunkCount, -1);
+	for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+	{
+		mSlotTiles[i].assign((size_t)mChunkTilesX * mChunkTilesY, EMPTY_TILE);
+		mSlotState[i] = SLOT_FREE;
+		mSlotChunk[i] = -1;
+	}
+
+	mSignal = SDL_CreateSemaphore(0);
+	if (mSignal == NULL)
+	{
+		printf("Chunk loader semaphore could not be created! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+
+	mRunning = true;
+	mThread = SDL_CreateThread(loaderThread, "ChunkLoader", this);
+	if (mThread == NULL)
+	{
+		printf("Chunk loader thread could not be created! SDL Error: %s\n", SDL_GetError());
+		mRunning = false;
+		SDL_DestroySemaphore(mSignal);
+		mSignal = NULL;
+		return false;
+	}
+
+	printf("Level %s: %d chunks, %d pixels wide\n", path.c_str(), mChunkCount, getWidth());
+	return true;
+}
+
+void ChunkedLevel::close()
+{
+	if (mThread != NULL)
+	{
+		mRunning = false;
+		SDL_SemPost(mSignal);
+		SDL_WaitThread(mThread, NULL);
+		mThread = NULL;
+	}
+	if (mSignal != NULL)
+	{
+		SDL_DestroySemaphore(mSignal);
+		mSignal = NULL;
+	}
+
+	//Drain anything the loader finished on its way out
+	ChunkRequest request;
+	while (mRequests.pop(request))
+	{
+	}
+	ChunkResult result;
+	while (mResults.pop(result))
+	{
+	}
+
+	for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+	{
+		mSlotState[i] = SLOT_FREE;
+		mSlotChunk[i] = -1;
+	}
+	mChunkSlot.clear();
+	mTileset = NULL;
+	++mVersion;
+}
+
+void ChunkedLevel::reloadTileset()
+{
+	if (!mTilesetPath.empty())
+	{
+		mTileset = gThemes.get(mTilesetPath, gTheme);
+		++mVersion;
+	}
+}
+
+bool ChunkedLevel::readChunk(std::ifstream& file, int chunk, Uint16* tiles)
+{
+	file.clear();
+	file.seekg(mChunkOffsets[chunk]);
+
+	int count = mChunkTilesX * mChunkTilesY;
+	for (int i = 0; i < count; ++i)
+	{
+		int id = 0;
+		if (!(file >> id))
+		{
+			return false;
+		}
+		tiles[i] = (id < 0) ? EMPTY_TILE : (Uint16)id;
+	}
+	return true;
+}
+
+int ChunkedLevel::loaderThread(void* data)
+{
+	ChunkedLevel* level = (ChunkedLevel*)data;
+
+	//The loader keeps its own handle so seeks never race the game thread
+	std::ifstream file(level->mPath.c_str(), std::ios::binary);
+
+	ChunkRequest request;
+	while (level->mRunning.load())
+	{
+		//Sleep until something is requested, then load everything that is waiting
+		SDL_SemWait(level->mSignal);
+		while (level->mRequests.pop(request))
+		{
+			ChunkResult result;
+			result.chunk = request.chunk;
+			result.slot = request.slot;
+			result.requestTime = request.requestTime;
+			result.ok = file.is_open() && level->readChunk(file, request.chunk, level->mSlotTiles[request.slot].data());
+			result.doneTime = SDL_GetPerformanceCounter();
+
+			//The result queue is as big as the request queue, so this can't fail
+			level->mResults.push(result);
+		}
+	}
+
+	return 0;
+}
+
+void ChunkedLevel::update(const SDL_Rect& camera)
+{
+	if (!isOpen())
+	{
+		return;
+	}
+
+	//Take in finished loads
+	ChunkResult result;
+	while (mResults.pop(result))
+	{
+		++mVersion;
+		if (result.ok)
+		{
+			mSlotState[result.slot] = SLOT_READY;
+
+			double ms = (result.doneTime - result.requestTime) * 1000.0 / SDL_GetPerformanceFrequency();
+			++mLoads;
+			mTotalLoadMs += ms;
+			if (ms > mMaxLoadMs)
+			{
+				mMaxLoadMs = ms;
+			}
+		}
+		else
+		{
+			printf("Failed to load chunk %d of %s!\n", result.chunk, mPath.c_str());
+			++mFailedLoads;
+			mSlotState[result.slot] = SLOT_FREE;
+			mSlotChunk[result.slot] = -1;
+			mChunkSlot[result.chunk] = -1;
+		}
+	}
+
+	int chunkPixels = mChunkTilesX * mTileSize;
+	int first = camera.x / chunkPixels - CHUNK_MARGIN;
+	int last = (camera.x + camera.w - 1) / chunkPixels + CHUNK_MARGIN;
+	if (first < 0)
+	{
+		first = 0;
+	}
+	if (last >= mChunkCount)
+	{
+		last = mChunkCount - 1;
+	}
+
+	//Evict chunks that drifted out of range, ones still loading are left to finish
+	for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+	{
+		if (mSlotState[i] == SLOT_READY && (mSlotChunk[i] < first || mSlotChunk[i] > last))
+		{
+			mChunkSlot[mSlotChunk[i]] = -1;
+			mSlotChunk[i] = -1;
+			mSlotState[i] = SLOT_FREE;
+			++mEvictions;
+			++mVersion;
+		}
+	}
+
+	//Ask for anything in range that isn't here yet
+	for (int chunk = first; chunk <= last; ++chunk)
+	{
+		if (mChunkSlot[chunk] >= 0)
+		{
+			continue;
+		}
+
+		int slot = -1;
+		for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+		{
+			if (mSlotState[i] == SLOT_FREE)
+			{
+				slot = i;
+				break;
+			}
+		}
+		if (slot < 0)
+		{
+			break;
+		}
+
+		ChunkRequest request = { chunk, slot, SDL_GetPerformanceCounter() };
+		if (!mRequests.push(request))
+		{
+			break;
+		}
+		SDL_SemPost(mSignal);
+		mSlotState[slot] = SLOT_LOADING;
+		mSlotChunk[slot] = chunk;
+		mChunkSlot[chunk] = slot;
+	}
+}
+
+void ChunkedLevel::render(const SDL_Rect& camera)
+{
+	if (!isOpen() || mTileset == NULL)
+	{
+		return;
+	}
+
+	int tilesetColumns = mTileset->getWidth() / mTileSize;
+	int chunkPixels = mChunkTilesX * mTileSize;
+
+	for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+	{
+		if (mSlotState[i] != SLOT_READY)
+		{
+			continue;
+		}
+
+		int chunkX = mSlotChunk[i] * chunkPixels;
+		if (chunkX + chunkPixels <= camera.x || chunkX >= camera.x + camera.w)
+		{
+			continue;
+		}
+
+		const Uint16* tiles = mSlotTiles[i].data();
+		for (int ty = 0; ty < mChunkTilesY; ++ty)
+		{
+			int y = ty * mTileSize;
+			if (y + mTileSize <= camera.y || y >= camera.y + camera.h)
+			{
+				continue;
+			}
+			for (int tx = 0; tx < mChunkTilesX; ++tx)
+			{
+				Uint16 id = tiles[ty * mChunkTilesX + tx];
+				int x = chunkX + tx * mTileSize;
+				if (id == EMPTY_TILE || x + mTileSize <= camera.x || x >= camera.x + camera.w)
+				{
+					continue;
+				}
+
+				SDL_Rect clip = { (id % tilesetColumns) * mTileSize, (id / tilesetColumns) * mTileSize, mTileSize, mTileSize };
+				mTileset->render(x - camera.x, y - camera.y, &clip);
+			}
+		}
+	}
+}
+
+int ChunkedLevel::getResidentCount() const
+{
+	int count = 0;
+	for (int i = 0; i < MAX_RESIDENT_CHUNKS; ++i)
+	{
+		if (mSlotState[i] == SLOT_READY)
+		{
+			++count;
+		}
+	}
+	return count;
+}
+
+void ChunkedLevel::printStats()
+{
+	printf("Level streaming: %d/%d chunks resident, %d loads (%d failed), %d evictions, load latency avg %.2f ms max %.2f ms\n",
+		getResidentCount(), MAX_RESIDENT_CHUNKS, mLoads, mFailedLoads, mEvictions, getAverageLoadMs(), getMaxLoadMs());
+}
+
+FrameCapture::FrameCapture()
+{
+	mWidth = 0;
+	mHeight = 0;
+	mThread = NULL;
+	mRunning = false;
+	mSignal = NULL;
+	mRepeats = 0;
+	mLastFrame = -1;
+	mCaptured = 0;
+	mDuplicated = 0;
+	mBehind = 0;
+	mWritten = 0;
+	mReadbackMs = 0.0;
+}
+
+FrameCapture::~FrameCapture()
+{
+	stop();
+}
+
+bool FrameCapture::start(std::string path, SDL_Renderer* renderer)
+{
+	stop();
+
+	if (SDL_GetRendererOutputSize(renderer, &mWidth, &mHeight) < 0)
+	{
+		printf("Unable to get renderer size for capture! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+
+	//4:2:0 needs even dimensions, an odd edge column or row is cropped
+	mWidth &= ~1;
+	mHeight &= ~1;
+
+	mFile.open(path.c_str(), std::ios::binary | std::ios::trunc);
+	if (!mFile)
+	{
+		printf("Unable to open capture file %s!\n", path.c_str());
+		return false;
+	}
+	mFile << "YUV4MPEG2 W" << mWidth << " H" << mHeight << " F60:1 Ip A1:1 C420jpeg\n";
+
+	//Everything the capture needs is allocated up front
+	for (int i = 0; i < CAPTURE_BUFFERS; ++i)
+	{
+		mFrames[i].assign((size_t)mWidth * mHeight, 0);
+		mFreeFrames.push(i);
+	}
+	mYUV.assign((size_t)mWidth * mHeight * 3 / 2, 0);
+	mLastFrame = -1;
+	mRepeats = 0;
+
+	mCaptured = 0;
+	mDuplicated = 0;
+	mBehind = 0;
+	mWritten = 0;
+	mReadbackMs = 0.0;
+
+	mSignal = SDL_CreateSemaphore(0);
+	if (mSignal == NULL)
+	{
+		printf("Unable to create capture semaphore! SDL Error: %s\n", SDL_GetError());
+		mFile.close();
+		return false;
+	}
+
+	mRunning = true;
+	mThread = SDL_CreateThread(writerThread, "CaptureWriter", this);
+	if (mThread == NULL)
+	{
+		printf("Capture writer thread could not be created! SDL Error: %s\n", SDL_GetError());
+		mRunning = false;
+		mFile.close();
+		SDL_DestroySemaphore(mSignal);
+		mSignal = NULL;
+		return false;
+	}
+
+	printf("Capturing %dx%d frames to %s\n", mWidth, mHeight, path.c_str());
+	return true;
+}
+
+void FrameCapture::stop()
+{
+	if (mThread == NULL)
+	{
+		return;
+	}
+
+	//The writer drains what is queued before it exits
+	mRunning = false;
+	SDL_SemPost(mSignal);
+	SDL_WaitThread(mThread, NULL);
+	mThread = NULL;
+	mFile.close();
+
+	int frame;
+	while (mFreeFrames.pop(frame))
+	{
+	}
+	while (mFullFrames.pop(frame))
+	{
+	}
+	SDL_DestroySemaphore(mSignal);
+	mSignal = NULL;
+
+	printStats();
+}
+
+void FrameCapture::captureFrame(SDL_Renderer* renderer)
+{
+	if (mThread == NULL)
+	{
+		return;
+	}
+
+	//The header promises a constant rate, so with every buffer queued the writer repeats a frame instead
+	int frame;
+	if (!mFreeFrames.pop(frame))
+	{
+		mRepeats.fetch_add(1);
+		++mBehind;
+		SDL_SemPost(mSignal);
+		return;
+	}
+
+	Uint64 start = SDL_GetPerformanceCounter();
+	SDL_Rect area = { 0, 0, mWidth, mHeight };
+	if (SDL_RenderReadPixels(renderer, &area, SDL_PIXELFORMAT_ARGB8888, mFrames[frame].data(), mWidth * 4) < 0)
+	{
+		printf("Unable to read back frame, repeating the last one! SDL Error: %s\n", SDL_GetError());
+
+		//The last buffer is only read by the writer, and nothing refills it until it comes back through the free queue
+		if (mLastFrame < 0)
+		{
+			memset(mFrames[frame].data(), 0, mFrames[frame].size() * sizeof(Uint32));
+		}
+		else if (mLastFrame != frame)
+		{
+			mFrames[frame] = mFrames[mLastFrame];
+		}
+		++mDuplicated;
+	}
+	else
+	{
+		mReadbackMs += (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+		++mCaptured;
+	}
+
+	mLastFrame = frame;
+	mFullFrames.push(frame);
+	SDL_SemPost(mSignal);
+}
+
+void FrameCapture::writeFrame(const Uint32* pixels)
+{
+	Uint8* yPlane = mYUV.data();
+	Uint8* uPlane = yPlane + mWidth * mHeight;
+	Uint8* vPlane = uPlane + (mWidth / 2) * (mHeight / 2);
+
+	//Full range BT.601, chroma averaged over each 2x2 block
+	for (int y = 0; y < mHeight; y += 2)
+	{
+		const Uint32* row0 = pixels + y * mWidth;
+		const Uint32* row1 = row0 + mWidth;
+		for (int x = 0; x < mWidth; x += 2)
+		{
+			Uint32 quad[4] = { row0[x], row0[x + 1], row1[x], row1[x + 1] };
+			int sumR = 0, sumG = 0, sumB = 0;
+			for (int i = 0; i < 4; ++i)
+			{
+				int r = (quad[i] >> 16) & 0xFF;
+				int g = (quad[i] >> 8) & 0xFF;
+				int b = quad[i] & 0xFF;
+				yPlane[(y + i / 2) * mWidth + x + i % 2] = (Uint8)((77 * r + 150 * g + 29 * b) >> 8);
+				sumR += r;
+				sumG += g;
+				sumB += b;
+			}
+
+			int r = sumR / 4, g = sumG / 4, b = sumB / 4;
+			int u = ((-43 * r - 85 * g + 128 * b) >> 8) + 128;
+			int v = ((128 * r - 107 * g - 21 * b) >> 8) + 128;
+			int chroma = (y / 2) * (mWidth / 2) + x / 2;
+			uPlane[chroma] = (Uint8)(u < 0 ? 0 : (u > 255 ? 255 : u));
+			vPlane[chroma] = (Uint8)(v < 0 ? 0 : (v > 255 ? 255 : v));
+		}
+	}
+
+	mFile << "FRAME\n";
+	mFile.write((const char*)mYUV.data(), mYUV.size());
+}
+
+int FrameCapture::writerThread(void* data)
+{
+	FrameCapture* capture = (FrameCapture*)data;
+	int frame;
+
+	while (true)
+	{
+		//Sleep until a frame is queued, then write everything that is waiting
+		SDL_SemWait(capture->mSignal);
+		while (capture->mFullFrames.pop(frame))
+		{
+			capture->writeFrame(capture->mFrames[frame].data());
+			capture->mFreeFrames.push(frame);
+			capture->mWritten.fetch_add(1);
+
+			//Frames dropped while this one was queued are copies of it, the conversion is still in mYUV
+			int repeats = capture->mRepeats.exchange(0);
+			for (int i = 0; i < repeats; ++i)
+			{
+				capture->mFile << "FRAME\n";
+				capture->mFile.write((const char*)capture->mYUV.data(), capture->mYUV.size());
+			}
+			capture->mWritten.fetch_add(repeats);
+		}
+
+		if (!capture->mRunning.load())
+		{
+			break;
+		}
+	}
+
+	return 0;
+}
+
+void FrameCapture::printStats()
+{
+	printf("Capture: %d frames captured, %d repeated, %d written, readback avg %.2f ms\n",
+		mCaptured, mDuplicated, mWritten.load(), mCaptured > 0 ? mReadbackMs / mCaptured : 0.0);
+	printf("Capture: writer fell behind %d times, each written as a repeat of the last frame\n", mBehind);
+}
+
+DynamicResolution::DynamicResolution()
+{
+	mTarget = NULL;
+	mWidth = 0;
+	mHeight = 0;
+	mBudgetMs = 0.0;
+	mScale = MAX_SCALE;
+	mOverBudgetFrames = 0;
+	mUnderBudgetFrames = 0;
+	mLastPresent = 0;
+}
+
+DynamicResolution::~DynamicResolution()
+{
+	free();
+}
+
+bool DynamicResolution::init(SDL_Renderer* renderer, int width, int height, double budgetMs)
+{
+	free();
+
+	//Sized for full scale, lower scales only use the top left part of it
+	mTarget = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, width, height);
+	if (mTarget == NULL)
+	{
+		printf("Unable to create dynamic resolution target! SDL Error: %s\n", SDL_GetError());
+		return false;
+	}
+
+	mWidth = width;
+	mHeight = height;
+	mBudgetMs = budgetMs;
+	mScale = MAX_SCALE;
+	mOverBudgetFrames = 0;
+	mUnderBudgetFrames = 0;
+	mLastPresent = 0;
+	return true;
+}
+
+void DynamicResolution::free()
+{
+	if (mTarget != NULL)
+	{
+		SDL_DestroyTexture(mTarget);
+		mTarget = NULL;
+	}
+}
+
+void DynamicResolution::beginWorld(SDL_Renderer* renderer)
+{
+	if (mTarget == NULL)
+	{
+		return;
+	}
+
+	SDL_SetRenderTarget(renderer, mTarget);
+	SDL_RenderSetScale(renderer, mScale, mScale);
+}
+
+void DynamicResolution::endWorld(SDL_Renderer* renderer)
+{
+	if (mTarget == NULL)
+	{
+		return;
+	}
+
+	SDL_RenderSetScale(renderer, 1.0f, 1.0f);
+	SDL_SetRenderTarget(renderer, NULL);
+
+	SDL_Rect source = { 0, 0, (int)(mWidth * mScale), (int)(mHeight * mScale) };
+	SDL_RenderCopy(renderer, mTarget, &source, NULL);
+}
+
+void DynamicResolution::framePresented()
+{
+	if (mTarget == NULL)
+	{
+		return;
+	}
+
+	//Present to present covers the readback, the present itself and any vsync wait
+	Uint64 now = SDL_GetPerformanceCounter();
+	Uint64 last = mLastPresent;
+	mLastPresent = now;
+	if (last == 0)
+	{
+		return;
+	}
+	double frameMs = (now - last) * 1000.0 / SDL_GetPerformanceFrequency();
+
+	if (frameMs > mBudgetMs)
+	{
+		++mOverBudgetFrames;
+		mUnderBudgetFrames = 0;
+	}
+	else if (frameMs < mBudgetMs * HEADROOM)
+	{
+		++mUnderBudgetFrames;
+		mOverBudgetFrames = 0;
+	}
+	else
+	{
+		//Inside the band, hold the current scale
+		mOverBudgetFrames = 0;
+		mUnderBudgetFrames = 0;
+	}
+
+	if (mOverBudgetFrames >= DOWNSCALE_FRAMES && mScale > MIN_SCALE)
+	{
+		mScale = mScale - SCALE_STEP < MIN_SCALE ? MIN_SCALE : mScale - SCALE_STEP;
+		mOverBudgetFrames = 0;
+		printf("Dynamic resolution: scale down to %.0f%%\n", mScale * 100.0f);
+	}
+	else if (mUnderBudgetFrames >= UPSCALE_FRAMES && mScale < MAX_SCALE)
+	{
+		mScale = mScale + SCALE_STEP > MAX_SCALE ? MAX_SCALE : mScale + SCALE_STEP;
+		mUnderBudgetFrames = 0;
+		printf("Dynamic resolution: scale up to %.0f%%\n", mScale * 100.0f);
+	}
+}
+
+//Names for the layer stats
+const char* const gLayerNames[LAYER_TOTAL] = { "background" };
+
+LayerCompositor::LayerCompositor()
+{
+	mRenderer = NULL;
+	mWidth = 0;
+	mHeight = 0;
+	mPreviousTarget = NULL;
+	for (int i = 0; i < LAYER_TOTAL; ++i)
+	{
+		mLayers[i].target = NULL;
+		mLayers[i].valid = false;
+		mLayers[i].content = 0;
+		mLayers[i].hits = 0;
+		mLayers[i].misses = 0;
+	}
+}
+
+LayerCompositor::~LayerCompositor()
+{
+	free();
+}
+
+bool LayerCompositor::init(SDL_Renderer* renderer, int width, int height)
+{
+	free();
+
+	for (int i = 0; i < LAYER_TOTAL; ++i)
+	{
+		mLayers[i].target = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, width, height);
+		if (mLayers[i].target == NULL)
+		{
+			printf("Unable to create %s layer target! SDL Error: %s\n", gLayerNames[i], SDL_GetError());
+			free();
+			return false;
+		}
+	}
+
+	//Layers cover everything under them, so they are copied without blending
+	for (int i = 0; i < LAYER_TOTAL; ++i)
+	{
+		SDL_SetTextureBlendMode(mLayers[i].target, SDL_BLENDMODE_NONE);
+	}
+
+	mRenderer = renderer;
+	mWidth = width;
+	mHeight = height;
+	invalidateAll();
+	return true;
+}
+
+void LayerCompositor::free()
+{
+	for (int i = 0; i < LAYER_TOTAL; ++i)
+	{
+		if (mLayers[i].target != NULL)
+		{
+			SDL_DestroyTexture(mLayers[i].target);
+			mLayers[i].target = NULL;
+		}
+		mLayers[i].valid = false;
+	}
+	mRenderer = NULL;
+}
+
+bool LayerCompositor::beginLayer(LayerId layer, const SDL_Rect& view, int content)
+{
+	Layer& l = mLayers[layer];
+	if (l.valid && l.content == content && l.view.x == view.x && l.view.y == view.y && l.view.w == view.w && l.view.h == view.h)
+	{
+		++l.hits;
+		return false;
+	}
+	++l.misses;
+
+	l.valid = true;
+	l.view = view;
+	l.content = content;
+
+	mPreviousTarget = SDL_GetRenderTarget(mRenderer);
+	SDL_SetRenderTarget(mRenderer, l.target);
+
+	//Opaque white under the layer like the screen clear
+	SDL_SetRenderDrawColor(mRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+	SDL_RenderClear(mRenderer);
+	return true;
+}
+
+void LayerCompositor::endLayer()
+{
+	SDL_SetRenderTarget(mRenderer, mPreviousTarget);
+	mPreviousTarget = NULL;
+}
+
+void LayerCompositor::drawLayer(LayerId layer)
+{
+	SDL_Rect screen = { 0, 0, mWidth, mHeight };
+	SDL_RenderCopy(mRenderer, mLayers[layer].target, NULL, &screen);
+}
+
+void LayerCompositor::invalidateAll()
+{
+	for (int i = 0; i < LAYER_TOTAL; ++i)
+	{
+		mLayers[i].valid = false;
+	}
+}
+
+int LayerCompositor::getHitRate(LayerId layer) const
+{
+	long long total = mLayers[layer].hits + mLayers[layer].misses;
+	return total > 0 ? (int)(mLayers[layer].hits * 100 / total) : 0;
+}
+
+void LayerCompositor::printStats()
+{
+	if (!isEnabled())
+	{
+		return;
+	}
+
+	for (int i = 0; i < LAYER_TOTAL; ++i)
+	{
+		if (mLayers[i].hits + mLayers[i].misses == 0)
+		{
+			continue;
+		}
+		printf("Layer %s: %lld hits, %lld redraws, %d%% hit rate\n",
+			gLayerNames[i], mLayers[i].hits, mLayers[i].misses, getHitRate((LayerId)i));
+	}
+}
+
+Enemy* WaveSpawner::findSweptCollision(const CollisionShape& shape, float velX, float velY, float* toi)
+{
+	//Broad phase: only enemies filed under the cells the move covers, and touching its bounds, are worth sweeping
+	SDL_Rect bounds = sweptBounds(shape.box, velX, velY);
+	mSweepShapes.clear();
+	mSweepIndices.clear();
+	if (mGridColumns == 0)
+	{
+		return NULL;
+	}
+
+	++mQuery;
+	int firstColumn, firstRow, lastColumn, lastRow;
+	getCellRange(bounds, firstColumn, firstRow, lastColumn, lastRow);
+	for (int row = firstRow; row <= lastRow; ++row)
+	{
+		for (int column = firstColumn; column <= lastColumn; ++column)
+		{
+			int cell = row * mGridColumns + column;
+			for (int k = mCellStart[cell]; k < mCellStart[cell + 1]; ++k)
+			{
+				int index = mCellEnemies[k];
+				if (mVisited[index] == mQuery)
+				{
+					continue;
+				}
+				mVisited[index] = mQuery;
+
+				//Something may have killed it since the grid was built
+				Enemy& enemy = mPool[index];
+				if (enemy.isDead())
+				{
+					continue;
+				}
+
+				CollisionShape target = enemy.getShape();
+				if (checkCollision(bounds, target.box))
+				{
+					mSweepShapes.push_back(target);
+					mSweepIndices.push_back(index);
+				}
+			}
+		}
+	}
+
+	//Narrow phase: earliest time of impact along the move, down to the pixel
+	int hit = sweepCollisionBatch(shape, velX, velY, mSweepShapes.data(), (int)mSweepShapes.size(), toi);
+	return hit >= 0 ? &mPool[mSweepIndices[hit]] : NULL;
+}
+
+void Dot::handleEvent(SDL_Event& e, SimContext& sim)
+{
+	if (e.type == SDL_KEYDOWN && e.key.repeat == 0)
+	{
+		switch (e.key.keysym.sym)
+		{
+		case SDLK_LEFT:
+			mHeldLeft = true;
+			updateVelocity();
+			mFlipType = SDL_FLIP_HORIZONTAL;
+			mState = WALKING;
+			break;
+		case SDLK_RIGHT:
+			mHeldRight = true;
+			updateVelocity();
+			mFlipType = SDL_FLIP_NONE;
+			mState = WALKING;
+			break;
+		case SDLK_SPACE: // Fire projectile
+		{
+			if (mHealth <= 0)
+			{
+				break;
+			}
+			gAnimations.play(mAnim, CLIP_SHOT);
+			int direction = (mFlipType == SDL_FLIP_NONE) ? 1 : -1;
+			int projX = (direction == 1) ? mPosX + DOT_WIDTH : mPosX - 20;
+			int projY = mPosY + 85;
+			sim.projectiles.emplace_back(projX, projY, direction);
+			sim.sounds.push_back(SOUND_SHOT);
+			EffectEvent muzzle = { EMITTER_MUZZLE, (float)(direction == 1 ? projX : projX + Projectile::PROJECTILE_WIDTH), (float)projY + Projectile::PROJECTILE_HEIGHT / 2, (float)direction };
+			sim.effects.push_back(muzzle);
+			break;
+		}
+		}
+	}
+	else if (e.type == SDL_KEYUP && e.key.repeat == 0)
+	{
+		switch (e.key.keysym.sym)
+		{
+		case SDLK_LEFT:
+			mHeldLeft = false;
+			break;
+		case SDLK_RIGHT:
+			mHeldRight = false;
+			break;
+		}
+
+		//A release the dot never saw pressed leaves it standing rather than drifting
+		updateVelocity();
+		if (mVelX == 0)
+		{
+			mState = IDLE;
+		}
+	}
+}
+
+void Dot::updateVelocity()
+{
+	mVelX = 0;
+	if (mHeldLeft)
+	{
+		mVelX -= DOT_VEL;
+	}
+	if (mHeldRight)
+	{
+		mVelX += DOT_VEL;
+	}
+	mVelY = 0;
+}
+
+void Dot::syncInput(bool heldLeft, bool heldRight)
+{
+	mHeldLeft = heldLeft;
+	mHeldRight = heldRight;
+	updateVelocity();
+
+	if (mVelX < 0)
+	{
+		mFlipType = SDL_FLIP_HORIZONTAL;
+	}
+	else if (mVelX > 0)
+	{
+		mFlipType = SDL_FLIP_NONE;
+	}
+	mState = (mHeldLeft || mHeldRight) ? WALKING : IDLE;
+}
+
+void Dot::move(WaveSpawner& enemies, SimContext& sim)
+{
+	updateAnimation();
+
+	//The dead don't walk
+	if (mHealth <= 0)
+	{
+		return;
+	}
+
+	//Don't step off the level
+	int stepX = mVelX;
+	if ((mPosX + stepX < 0) || (mPosX + stepX + DOT_WIDTH > sim.levelWidth))
+	{
+		stepX = 0;
+	}
+
+	//Stop against the first enemy along the way instead of stepping into it
+	float toi = 1.0f;
+	if (enemies.findSweptCollision(getShape(), (float)stepX, 0.0f, &toi) != NULL)
+	{
+		mPosX += (int)lroundf(stepX * toi);
+		touchEnemy(sim);
+	}
+	else
+	{
+		mPosX += stepX;
+	}
+
+	int stepY = mVelY;
+	if ((mPosY + stepY < 0) || (mPosY + stepY + DOT_HEIGHT > LEVEL_HEIGHT))
+	{
+		stepY = 0;
+	}
+
+	if (enemies.findSweptCollision(getShape(), 0.0f, (float)stepY, &toi) != NULL)
+	{
+		mPosY += (int)lroundf(stepY * toi);
+		touchEnemy(sim);
+	}
+	else
+	{
+		mPosY += stepY;
+	}
+}
+
+void Dot::touchEnemy(SimContext& sim)
+{
+	if (sim.frame - lastDamageFrame >= DAMAGE_COOLDOWN_FRAMES)
+	{
+		reduceHealth(25);
+		lastDamageFrame = sim.frame;  // Reset timer
+		gAnimations.play(mAnim, mHealth > 0 ? CLIP_HURT : CLIP_DEAD);
+	}
+}
+
+void Dot::updateAnimation()
+{
+	gAnimations.advance(mAnim);
+
+	//Between one-off clips the loop follows whether the dot is moving
+	if (mHealth > 0 && gAnimations.isLooping(mAnim))
+	{
+		gAnimations.play(mAnim, mState == WALKING ? CLIP_RUN : CLIP_IDLE);
+	}
+}
+
+void Enemy::move()
+{
+	mPosX += mVelX;
+
+	if ((mPosX < 0) || (mPosX + ENEMY_WIDTH > SCREEN_WIDTH))
+	{
+		mPosX -= mVelX;
+	}
+
+	mPosY += mVelY;
+
+	if ((mPosY < 0) || (mPosY + ENEMY_HEIGHT > SCREEN_HEIGHT))
+	{
+		mPosY -= mVelY;
+	}
+	
 }
 
-LTexture::~LTexture()
+void Dot::render(int camX, int camY)
 {
-	//Deallocate
-	free();
+	gAnimations.render(mAnim, mPosX - camX, mPosY - camY, mFlipType);
+
+	SDL_Rect colRect = getCollider();
+	colRect.x -= camX;
+	colRect.y -= camY;
+	SDL_SetRenderDrawColor(gRenderer, 255, 255, 255, 255);
+	SDL_RenderDrawRect(gRenderer, &colRect);
 }
 
-bool LTexture::loadFromFile(std::string path)
+void Enemy::render(int camX, int camY)
 {
-	//Get rid of preexisting texture
-	free();
+	gAnimations.render(mAnim, mPosX - camX, mPosY - camY);
 
-	//The final texture
-	SDL_Texture* newTexture = NULL;
-
-	//Load image at specified path
-	SDL_Surface* loadedSurface = IMG_Load(path.c_str());
-	if (loadedSurface == NULL)
+	LTexture* healthTexture = gHealthLabels.get(health);
+	if (healthTexture != NULL)
 	{
-		printf("Unable to load image %s! SDL_image Error: %s\n", path.c_str(), IMG_GetError());
+		healthTexture->render(mPosX - camX, mPosY - camY - 20); // Position above enemy
 	}
-	else
+	SDL_Rect colRect = getCollider();
+	colRect.x -= camX;
+	colRect.y -= camY;
+	SDL_SetRenderDrawColor(gRenderer, 255, 255, 255, 255);
+	SDL_RenderDrawRect(gRenderer, &colRect);
+}
+
+LTexture* HealthLabels::get(int health)
+{
+	if (health < 0 || health > Enemy::ENEMY_MAX_HEALTH)
 	{
-		//Color key image
+		return NULL;
+	}
 
-		SDL_SetColorKey(loadedSurface, SDL_TRUE, SDL_MapRGB(loadedSurface->format, 0, 0xFF, 0xFF));
-		//Create texture from surface pixels
-		newTexture = SDL_CreateTextureFromSurface(gRenderer, loadedSurface);
-		if (newTexture == NULL)
-		{
-			printf("Unable to create texture from %s! SDL Error: %s\n", path.c_str(), SDL_GetError());
-		}
-		else
+	LTexture& label = mLabels[health];
+	if (label.getWidth() == 0)
+	{
+		SDL_Color textColor = { 255, 0, 0, 255 };  // Red color for health
+		if (!label.loadFromRenderedText(std::to_string(health), textColor))
 		{
-			//Get image dimensions
-			mWidth = loadedSurface->w;
-			mHeight = loadedSurface->h;
+			return NULL;
 		}
+	}
+	return &label;
+}
 
-		//Get rid of old loaded surface
-		SDL_FreeSurface(loadedSurface);
+void HealthLabels::free()
+{
+	for (int i = 0; i <= Enemy::ENEMY_MAX_HEALTH; ++i)
+	{
+		mLabels[i].free();
 	}
+}
 
-	//Return success
-	mTexture = newTexture;
-	return mTexture != NULL;
+int Dot::getPosX()
+{
+	return mPosX;
 }
 
-bool LTexture::loadFromRenderedText(std::string textureText, SDL_Color textColor)
+int Dot::getPosY()
 {
-	free();
-	SDL_Surface* textSurface = TTF_RenderText_Solid(gFont, textureText.c_str(), textColor);
-	if (textSurface == NULL)
+	return mPosY;
+}
+
+Simulation::Simulation()
+{
+	mContext.frame = 0;
+	mContext.levelWidth = LEVEL_WIDTH;
+	mRecording = true;
+	mHeldLeft = false;
+	mHeldRight = false;
+
+	mCamera.x = 50;
+	mCamera.y = 50;
+	mCamera.w = SCREEN_WIDTH;
+	mCamera.h = SCREEN_HEIGHT;
+}
+
+void Simulation::handleEvent(SDL_Event& e)
+{
+	//Follow the arrow keys from the events themselves, so a rewind replays the same way every run
+	if ((e.type == SDL_KEYDOWN || e.type == SDL_KEYUP) && e.key.repeat == 0)
 	{
-		printf("unable to render text surface! SDL_ttf Error: %s\n", TTF_GetError());
+		bool down = e.type == SDL_KEYDOWN;
+		if (e.key.keysym.sym == SDLK_LEFT)
+		{
+			mHeldLeft = down;
+		}
+		else if (e.key.keysym.sym == SDLK_RIGHT)
+		{
+			mHeldRight = down;
+		}
 	}
-	else
+
+	//Rewind the simulation as far as the ring goes back
+	if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_r)
 	{
-		mTexture = SDL_CreateTextureFromSurface(gRenderer, textSurface);
-		if (mTexture == NULL)
+		if (mSnapshots.restore(mSnapshots.getCount(), mContext, mDot, mWaves))
 		{
-			printf("unable to create texture from rendered text! SDL Error: %s\n", SDL_GetError());
+			//The snapshot's velocity came from keys held back then, take it from now instead
+			mDot.syncInput(mHeldLeft, mHeldRight);
 
+			printf("Rewound to frame %u (%d bytes, restore %.1f us, last save %.1f us)\n",
+				mContext.frame, mSnapshots.getLastSize(), mSnapshots.getLastRestoreMicros(), mSnapshots.getLastSaveMicros());
 		}
-		else
-		{
-			mWidth = textSurface->w;
-			mHeight = textSurface->h;
-		}
-		SDL_FreeSurface(textSurface);
 	}
-	return mTexture != NULL;
+
+	//Handle input for the dot
+	mDot.handleEvent(e, mContext);
 }
 
-bool checkCollision(SDL_Rect a, SDL_Rect b)
+bool Simulation::isInput(const SDL_Event& e)
 {
-	// The sides of the rectangles
-	int leftA = a.x;
-	int rightA = a.x + a.w;
-	int topA = a.y;
-	int bottomA = a.y + a.h;
-
-	int leftB = b.x;
-	int rightB = b.x + b.w;
-	int topB = b.y;
-	int bottomB = b.y + b.h;
-
-	// Check if rectangles overlap
-	if (bottomA <= topB)
+	if ((e.type != SDL_KEYDOWN && e.type != SDL_KEYUP) || e.key.repeat != 0)
 	{
 		return false;
 	}
 
-	if (topA >= bottomB)
+	switch (e.key.keysym.sym)
 	{
-		return false;
+	case SDLK_LEFT:
+	case SDLK_RIGHT:
+		return true;
+	case SDLK_SPACE:
+	case SDLK_r:
+		return e.type == SDL_KEYDOWN;
 	}
+	return false;
+}
 
-	if (rightA <= leftB)
+void Simulation::step(const SDL_Event* events, int eventCount)
+{
+	//Whatever the last frame raised has been handed out or dropped by now
+	mContext.effects.clear();
+	mContext.sounds.clear();
+
+	for (int i = 0; i < eventCount; ++i)
 	{
-		return false;
+		SDL_Event e = events[i];
+		handleEvent(e);
 	}
 
-	if (leftA >= rightB)
+	//Record the frame before it is simulated
+	if (mRecording)
 	{
-		return false;
+		mSnapshots.save(mContext, mDot, mWaves);
 	}
 
-	// If none of the sides are outside, the rectangles overlap
-	return true;
-}
+	mWaves.update(mContext);
 
+	mDot.move(mWaves, mContext);
 
+	++mContext.frame;
 
-void LTexture::free()
-{
-	//Free texture if it exists
-	if (mTexture != NULL)
+	//Center the camera over the dot
+	mCamera.x = (mDot.getPosX() + Dot::DOT_WIDTH / 2) - SCREEN_WIDTH / 2;
+	mCamera.y = (mDot.getPosY() + Dot::DOT_HEIGHT / 2) - SCREEN_HEIGHT / 2;
+
+	//Keep the camera in bounds
+	if (mCamera.x < 0)
 	{
-		SDL_DestroyTexture(mTexture);
-		mTexture = NULL;
-		mWidth = 0;
-		mHeight = 0;
+		mCamera.x = 0;
+	}
+	if (mCamera.y < 0)
+	{
+		mCamera.y = 0;
+	}
+	if (mCamera.x > mContext.levelWidth - mCamera.w)
+	{
+		mCamera.x = mContext.levelWidth - mCamera.w;
+	}
+	if (mCamera.y > LEVEL_HEIGHT - mCamera.h)
+	{
+		mCamera.y = LEVEL_HEIGHT - mCamera.h;
+	}
+
+	// Update projectiles
+	std::vector<Projectile>& projectiles = mContext.projectiles;
+	for (auto it = projectiles.begin(); it != projectiles.end(); ) {
+		// Sweep the whole move so fast projectiles can't pass through an enemy
+		float toi = 1.0f;
+		CollisionShape shot = { it->getCollider(), NULL, 0, 0 };
+		Enemy* target = mWaves.findSweptCollision(shot, (float)it->getVelX(), 0.0f, &toi);
+		if (target != NULL) {
+			SDL_Rect hit = it->getCollider();
+			hit.x += (int)(it->getVelX() * toi);
+			EffectEvent spark = { EMITTER_HIT, (float)(hit.x + hit.w / 2), (float)(hit.y + hit.h / 2), it->getDirection() == 1 ? -1.0f : 1.0f };
+			mContext.effects.push_back(spark);
+			target->takeDamage(10, mContext);
+			it = projectiles.erase(it); // Remove projectile after hit
+			continue;
+		}
+
+		it->move();
+		if (it->isOffScreen(mContext.levelWidth)) {
+			it = projectiles.erase(it); // Remove projectile if off-screen
+		}
+		else {
+			++it;
+		}
 	}
 }
 
-void LTexture::setColor(Uint8 red, Uint8 green, Uint8 blue)
+void Simulation::copyFrame(RenderFrame& out)
 {
-	//Modulate texture rgb
-	SDL_SetTextureColorMod(mTexture, red, green, blue);
+	//The buffers keep their capacity between frames
+	out.simFrame = mContext.frame;
+	out.camera = mCamera;
+	out.dot = mDot;
+	mWaves.copyActive(out.enemies);
+	out.projectiles = mContext.projectiles;
+	out.effects = mContext.effects;
+	out.sounds = mContext.sounds;
+	out.activeEnemies = mWaves.getActiveCount();
+	out.projectileCapacity = (int)mContext.projectiles.capacity();
 }
 
-void LTexture::setBlendMode(SDL_BlendMode blending)
+SimulationPipeline::SimulationPipeline()
 {
-	//Set blending function
-	SDL_SetTextureBlendMode(mTexture, blending);
+	mSimulation = NULL;
+	mFreeSignal = NULL;
+	mReadySignal = NULL;
+	mThread = NULL;
+	mRunning = false;
+	mRenderStalls = 0;
+	mSimulationStalls = 0;
+	mRenderStallTicks = 0;
+	mSimulationStallTicks = 0;
+	mFramesSimulated = 0;
+	mEventOverflows = 0;
+	mOverflow.reserve(EVENT_QUEUE_SIZE);
 }
 
-void LTexture::setAlpha(Uint8 alpha)
+SimulationPipeline::~SimulationPipeline()
 {
-	//Modulate texture alpha
-	SDL_SetTextureAlphaMod(mTexture, alpha);
+	stop();
 }
 
-void LTexture::render(int x, int y, SDL_Rect* clip, double angle, SDL_Point* center, SDL_RendererFlip flip)
+bool SimulationPipeline::start(Simulation* simulation)
 {
-	//Set rendering space and render to screen
-	SDL_Rect renderQuad = { x, y, mWidth, mHeight };
+	stop();
 
-	//Set clip rendering dimensions
-	if (clip != NULL)
+	mSimulation = simulation;
+	mFreeSignal = SDL_CreateSemaphore(0);
+	mReadySignal = SDL_CreateSemaphore(0);
+	if (mFreeSignal == NULL || mReadySignal == NULL)
 	{
-		renderQuad.w = clip->w;
-		renderQuad.h = clip->h;
+		printf("Unable to create pipeline semaphores! SDL Error: %s\n", SDL_GetError());
+		stop();
+		return false;
 	}
 
-	//Render to screen
-	SDL_RenderCopyEx(gRenderer, mTexture, clip, &renderQuad, angle, center, flip);
+	for (int i = 0; i < PIPELINE_FRAMES; ++i)
+	{
+		mFreeFrames.push(i);
+	}
+
+	mRunning = true;
+	mThread = SDL_CreateThread(simulationThread, "Simulation", this);
+	if (mThread == NULL)
+	{
+		printf("Simulation thread could not be created! SDL Error: %s\n", SDL_GetError());
+		mRunning = false;
+		stop();
+		return false;
+	}
+	return true;
 }
 
-int LTexture::getWidth()
+void SimulationPipeline::stop()
 {
-	return mWidth;
+	if (mThread != NULL)
+	{
+		mRunning = false;
+		SDL_SemPost(mFreeSignal);
+		SDL_WaitThread(mThread, NULL);
+		mThread = NULL;
+		printStats();
+	}
+
+	//Back to an empty pipeline
+	int frame;
+	while (mFreeFrames.pop(frame))
+	{
+	}
+	while (mReadyFrames.pop(frame))
+	{
+	}
+	SDL_Event e;
+	while (mEvents.pop(e))
+	{
+	}
+	mOverflow.clear();
+
+	if (mFreeSignal != NULL)
+	{
+		SDL_DestroySemaphore(mFreeSignal);
+		mFreeSignal = NULL;
+	}
+	if (mReadySignal != NULL)
+	{
+		SDL_DestroySemaphore(mReadySignal);
+		mReadySignal = NULL;
+	}
 }
 
-int LTexture::getHeight()
+void SimulationPipeline::flushOverflow()
 {
-	return mHeight;
+	size_t sent = 0;
+	while (sent < mOverflow.size() && mEvents.push(mOverflow[sent]))
+	{
+		++sent;
+	}
+	mOverflow.erase(mOverflow.begin(), mOverflow.begin() + sent);
 }
 
-Dot::Dot()
+void SimulationPipeline::postEvent(const SDL_Event& e)
 {
-	//Initialize the offsets
-	mPosX = 30;
-	mPosY = 800;
-
-	//Initialize the velocity
-	mVelX = 0;
-	mVelY = 0;
-	mState = IDLE;
-
-	mHealth = 100;
-	lastDamageTime = 0;
+	//A lost key release would leave the dot walking, so keep what doesn't fit for the next try
+	//Anything already kept back goes first so the simulation sees the keys in order
+	flushOverflow();
+	if (!mOverflow.empty() || !mEvents.push(e))
+	{
+		++mEventOverflows;
+		mOverflow.push_back(e);
+	}
 }
-Enemy::Enemy(int x, int y)
+
+int SimulationPipeline::simulationThread(void* data)
 {
-	mPosX = x;
-	mPosY = y;
+	SimulationPipeline* pipeline = (SimulationPipeline*)data;
 
-	mVelX = 0;
-	mVelY = 0;
-	health = ENEMY_MAX_HEALTH;
-}
+	//Input gathered for the frame being simulated
+	std::vector<SDL_Event> events;
+	events.reserve(EVENT_QUEUE_SIZE);
 
-void Dot::handleEvent(SDL_Event& e)
-{
-	if (e.type == SDL_KEYDOWN && e.key.repeat == 0)
+	while (pipeline->mRunning.load())
 	{
-		switch (e.key.keysym.sym)
+		//Wait for the renderer to give back a buffer
+		int frame;
+		if (!pipeline->mFreeFrames.pop(frame))
 		{
-		case SDLK_LEFT:
-			mVelX -= DOT_VEL;
-			flipType = SDL_FLIP_HORIZONTAL;
-			mState = WALKING;
-			break;
-		case SDLK_RIGHT:
-			mVelX += DOT_VEL;
-			flipType = SDL_FLIP_NONE;
-			mState = WALKING;
-			break;
-		case SDLK_SPACE: // Fire projectile
-		{
-			int direction = (flipType == SDL_FLIP_NONE) ? 1 : -1;
-			int projX = (direction == 1) ? mPosX + DOT_WIDTH : mPosX - 20;
-			int projY = mPosY + 85;
-			projectiles.emplace_back(projX, projY, direction);
-			break;
+			Uint64 start = SDL_GetPerformanceCounter();
+			pipeline->mSimulationStalls.fetch_add(1);
+			while (!pipeline->mFreeFrames.pop(frame))
+			{
+				if (!pipeline->mRunning.load())
+				{
+					return 0;
+				}
+
+				//Keep taking input while waiting so the queue has room for the renderer
+				SDL_Event e;
+				while (pipeline->mEvents.pop(e))
+				{
+					events.push_back(e);
+				}
+				SDL_SemWaitTimeout(pipeline->mFreeSignal, 10);
+			}
+			pipeline->mSimulationStallTicks.fetch_add(SDL_GetPerformanceCounter() - start);
 		}
+
+		SDL_Event e;
+		while (pipeline->mEvents.pop(e))
+		{
+			events.push_back(e);
 		}
+
+		pipeline->mSimulation->step(events.data(), (int)events.size());
+		events.clear();
+		pipeline->mSimulation->copyFrame(pipeline->mFrames[frame]);
+		pipeline->mFramesSimulated.fetch_add(1);
+
+		pipeline->mReadyFrames.push(frame);
+		SDL_SemPost(pipeline->mReadySignal);
 	}
-	else if (e.type == SDL_KEYUP && e.key.repeat == 0)
+
+	return 0;
+}
+
+RenderFrame* SimulationPipeline::acquireFrame()
+{
+	//Input that didn't fit last time gets another go every frame
+	flushOverflow();
+
+	int frame;
+	if (!mReadyFrames.pop(frame))
 	{
-		switch (e.key.keysym.sym)
+		Uint64 start = SDL_GetPerformanceCounter();
+		mRenderStalls.fetch_add(1);
+		while (!mReadyFrames.pop(frame))
 		{
-		case SDLK_LEFT:
-			mVelX += DOT_VEL;
-			break;
-		case SDLK_RIGHT:
-			mVelX -= DOT_VEL;
-			break;
+			SDL_SemWaitTimeout(mReadySignal, 10);
 		}
-		if (mVelX == 0)
+		mRenderStallTicks.fetch_add(SDL_GetPerformanceCounter() - start);
+	}
+	return &mFrames[frame];
+}
+
+void SimulationPipeline::releaseFrame(RenderFrame* frame)
+{
+	mFreeFrames.push((int)(frame - mFrames));
+	SDL_SemPost(mFreeSignal);
+}
+
+void SimulationPipeline::printStats()
+{
+	double frequency = (double)SDL_GetPerformanceFrequency();
+	printf("Pipeline: %d frames simulated, render waited %d times (%.1f ms), simulation waited %d times (%.1f ms), input held back %d times\n",
+		mFramesSimulated.load(), mRenderStalls.load(), mRenderStallTicks.load() * 1000.0 / frequency,
+		mSimulationStalls.load(), mSimulationStallTicks.load() * 1000.0 / frequency, mEventOverflows);
+}
+
+BatchRunner::BatchRunner()
+{
+	mFrames = 0;
+	mStressEnemies = 0;
+	mLevelWidth = LEVEL_WIDTH;
+	mNextInstance = 0;
+	mThreadCount = 0;
+	mElapsedMs = 0.0;
+}
+
+void BatchRunner::run(int instances, int frames, int stressEnemies, int levelWidth)
+{
+	mFrames = frames;
+	mStressEnemies = stressEnemies;
+	mLevelWidth = levelWidth;
+	mResults.assign(instances, Result());
+	mNextInstance = 0;
+
+	Uint64 start = SDL_GetPerformanceCounter();
+
+	//One worker per core, this thread being one of them
+	int threadCount = SDL_GetCPUCount();
+	threadCount = threadCount < instances ? threadCount : instances;
+	std::vector<SDL_Thread*> threads;
+	for (int i = 1; i < threadCount; ++i)
+	{
+		SDL_Thread* thread = SDL_CreateThread(workerThread, "BatchWorker", this);
+		if (thread == NULL)
 		{
-			mState = IDLE;
+			printf("Batch worker could not be created! SDL Error: %s\n", SDL_GetError());
+			break;
 		}
+		threads.push_back(thread);
+	}
+	mThreadCount = (int)threads.size() + 1;
+
+	work();
+	for (size_t i = 0; i < threads.size(); ++i)
+	{
+		SDL_WaitThread(threads[i], NULL);
+	}
+
+	mElapsedMs = (SDL_GetPerformanceCounter() - start) * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+int BatchRunner::workerThread(void* data)
+{
+	((BatchRunner*)data)->work();
+	return 0;
+}
+
+void BatchRunner::work()
+{
+	int index;
+	while ((index = mNextInstance.fetch_add(1)) < (int)mResults.size())
+	{
+		runInstance(index);
 	}
 }
 
-void Dot::move(SDL_Rect enemyCollider)
+//Makes a key event the way SDL would deliver it
+static void pushKey(std::vector<SDL_Event>& events, Uint32 type, SDL_Keycode key)
 {
-	mPosX += mVelX;
+	SDL_Event e;
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.key.repeat = 0;
+	e.key.keysym.sym = key;
+	events.push_back(e);
+}
 
-	if ((mPosX < 0) || (mPosX + DOT_WIDTH > LEVEL_WIDTH))
+void BatchRunner::runInstance(int index)
+{
+	Simulation simulation;
+	simulation.setRecording(false);
+	simulation.setLevelWidth(mLevelWidth);
+	if (mStressEnemies > 0)
 	{
-		mPosX -= mVelX;
+		simulation.getWaves().setStressSchedule(mStressEnemies);
 	}
 
-	if (checkCollision(getCollider(), enemyCollider))
+	Result& result = mResults[index];
+	result.seed = (Uint32)index + 1;
+	result.deathFrame = 0;
+
+	//The scripted player walks, stands and shoots at random, the same way for the same seed
+	Uint32 random = result.seed;
+	SDL_Keycode held = 0;
+	std::vector<SDL_Event> events;
+	for (int frame = 0; frame < mFrames; ++frame)
 	{
-		mPosX -= mVelX;
-		Uint32 currentTime = SDL_GetTicks();
-		if (currentTime - lastDamageTime >= 3000)  // 3000 ms = 3 seconds
+		events.clear();
+		if (frame % DECISION_FRAMES == 0)
 		{
-			reduceHealth(25);
-			lastDamageTime = currentTime;  // Reset timer
+			random = random * 1664525u + 1013904223u;
+			int choice = (int)((random >> 16) % 3);
+			SDL_Keycode want = choice == 0 ? SDLK_LEFT : (choice == 1 ? SDLK_RIGHT : 0);
+			if (want != held)
+			{
+				if (held != 0)
+				{
+					pushKey(events, SDL_KEYUP, held);
+				}
+				if (want != 0)
+				{
+					pushKey(events, SDL_KEYDOWN, want);
+				}
+				held = want;
+			}
+			if ((random >> 24) & 1)
+			{
+				pushKey(events, SDL_KEYDOWN, SDLK_SPACE);
+			}
 		}
-	}
 
-	mPosY += mVelY;
+		simulation.step(events.data(), (int)events.size());
 
-	if ((mPosY < 0) || (mPosY + DOT_HEIGHT > LEVEL_HEIGHT))
-	{
-		mPosY -= mVelY;
+		//Nothing more to learn once the dot is down
+		if (simulation.getDot().getHealth() <= 0)
+		{
+			result.deathFrame = simulation.getFrame();
+			break;
+		}
 	}
 
-	if (checkCollision(getCollider(), enemyCollider))
+	result.health = simulation.getDot().getHealth();
+	result.peakEnemies = simulation.getWaves().getPeakCount();
+	result.droppedEnemies = simulation.getWaves().getDroppedCount();
+}
+
+void BatchRunner::printStats()
+{
+	int survivors = 0;
+	long long totalHealth = 0;
+	long long simulatedFrames = 0;
+	for (size_t i = 0; i < mResults.size(); ++i)
 	{
-		mPosY -= mVelY;
-		Uint32 currentTime = SDL_GetTicks();
-		if (currentTime - lastDamageTime >= 3000)
+		const Result& result = mResults[i];
+		if (result.deathFrame == 0)
+		{
+			printf("Instance %u: survived with %d health, peak %d enemies, %d dropped\n",
+				result.seed, result.health, result.peakEnemies, result.droppedEnemies);
+			++survivors;
+			simulatedFrames += mFrames;
+		}
+		else
 		{
-			reduceHealth(25);
-			lastDamageTime = currentTime;
+			printf("Instance %u: died on frame %u, peak %d enemies, %d dropped\n",
+				result.seed, result.deathFrame, result.peakEnemies, result.droppedEnemies);
+			simulatedFrames += result.deathFrame;
 		}
+		totalHealth += result.health;
 	}
+
+	int count = (int)mResults.size();
+	printf("Batch: %d instances on %d threads, %d survived, average health %.1f\n",
+		count, mThreadCount, survivors, count > 0 ? (double)totalHealth / count : 0.0);
+	printf("Batch: %lld frames in %.0f ms, %.0f frames per second\n",
+		simulatedFrames, mElapsedMs, mElapsedMs > 0.0 ? simulatedFrames * 1000.0 / mElapsedMs : 0.0);
 }
 
-void Enemy::move()
+//Draws the level or the plain background under the camera
+void renderBackground(ChunkedLevel& level, const SDL_Rect& camera)
 {
-	mPosX += mVelX;
-
-	if ((mPosX < 0) || (mPosX + ENEMY_WIDTH > SCREEN_WIDTH))
+	if (level.isOpen())
 	{
-		mPosX -= mVelX;
+		level.render(camera);
 	}
-
-	mPosY += mVelY;
-
-	if ((mPosY < 0) || (mPosY + ENEMY_HEIGHT > SCREEN_HEIGHT))
+	else
 	{
-		mPosY -= mVelY;
+		SDL_Rect view = camera;
+		gBGTexture->render(0, 0, &view);
 	}
-	
 }
 
-void Dot::render(int camX, int camY)
+//Draws one simulated frame, dynamic resolution and capture are applied on the way
+void renderFrame(RenderFrame& frame, ChunkedLevel& level, LayerCompositor& compositor, DynamicResolution& dynamicResolution, FrameCapture& capture)
 {
-	SDL_Rect* currentClip = nullptr;
+	SDL_Rect camera = frame.camera;
+	level.update(camera);
+
+	//health
+	if (frame.dot.getHealth() != gHealthShown)
+	{
+		SDL_Color textColor = { 255, 255, 255 };  // White color
+		std::string healthText = "Health: " + std::to_string(frame.dot.getHealth());
+		if (gTextTexture.loadFromRenderedText(healthText, textColor))
+		{
+			gHealthShown = frame.dot.getHealth();
+		}
+	}
+
+	//The level's tiles are only redrawn when the camera moved or the level changed
+	//The plain background is a single copy that moves with the camera, caching it would only add a copy
+	bool cachedBackground = compositor.isEnabled() && level.isOpen();
+	if (cachedBackground && compositor.beginLayer(LAYER_BACKGROUND, camera, level.getVersion()))
+	{
+		renderBackground(level, camera);
+		compositor.endLayer();
+	}
 
-	if (mState == WALKING)
+	//World goes to the scaled target when dynamic resolution is on
+	dynamicResolution.beginWorld(gRenderer);
+
+	//The cached background covers the whole screen, so there is nothing to clear
+	//Neither is there when the plain background is big enough to fill the camera
+	bool coveredBackground = !level.isOpen() && gBGTexture != NULL && camera.x >= 0 && camera.y >= 0
+		&& camera.x + camera.w <= gBGTexture->getWidth() && camera.y + camera.h <= gBGTexture->getHeight();
+	if (cachedBackground)
 	{
-		currentClip = &gSpriteClips[SDL_GetTicks() / 100 % WALKING_ANIMATION_FRAMES];  // Cycle through walking animation
-		gWalkingSheetTexture.render(mPosX - camX, mPosY - camY, currentClip, 0.0, NULL, flipType);
+		compositor.drawLayer(LAYER_BACKGROUND);
 	}
 	else
 	{
-		currentClip = &gIdleClips[SDL_GetTicks() / 100 % IDLE_ANIMATION_FRAMES];  // Cycle through idle animation
-		gIdleSheetTexture.render(mPosX - camX, mPosY - camY, currentClip, 0.0, NULL, flipType);
+		if (!coveredBackground)
+		{
+			SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
+			SDL_RenderClear(gRenderer);
+		}
+		renderBackground(level, camera);
 	}
-	SDL_Rect colRect = getCollider();
-	colRect.x -= camX;
-	colRect.y -= camY;
-	SDL_SetRenderDrawColor(gRenderer, 255, 255, 255, 255);
-	SDL_RenderDrawRect(gRenderer, &colRect);
-}
 
-void Enemy::render(int camX, int camY)
-{
-	SDL_Rect* currentClip = &gEnemyclips[SDL_GetTicks() / 100 % ENEMY_ANIMATION_FRAMES];
-	gEnemyTexture.render(mPosX - camX, mPosY - camY, currentClip);
+	//Render objects
+	frame.dot.render(camera.x, camera.y);
 
-	SDL_Color textColor = { 255, 0, 0 };  // Red color for health
-	LTexture healthTexture;
+	for (size_t i = 0; i < frame.enemies.size(); ++i)
+	{
+		frame.enemies[i].render(camera.x, camera.y);
+	}
 
-	std::string healthText = std::to_string(health);  // Convert health to string
-	if (healthTexture.loadFromRenderedText(healthText, textColor))
+	for (auto& proj : frame.projectiles)
 	{
-		healthTexture.render(mPosX - camX, mPosY - camY - 20); // Position above enemy
+		proj.render(camera.x, camera.y);
 	}
-	SDL_Rect colRect = getCollider();
-	colRect.x -= camX;
-	colRect.y -= camY;
-	SDL_SetRenderDrawColor(gRenderer, 255, 255, 255, 255);
-	SDL_RenderDrawRect(gRenderer, &colRect);
-}
 
-int Dot::getPosX()
-{
-	return mPosX;
-}
+	//Effects live on the render side, the simulation only asks for them
+	for (size_t i = 0; i < frame.effects.size(); ++i)
+	{
+		const EffectEvent& effect = frame.effects[i];
+		gParticles.emit(effect.emitter, effect.x, effect.y, effect.dirX);
+	}
+	frame.effects.clear();
 
-int Dot::getPosY()
-{
-	return mPosY;
+	//Same for sounds, so the audio queue only ever has this thread feeding it
+	for (size_t i = 0; i < frame.sounds.size(); ++i)
+	{
+		gAudio.play(frame.sounds[i]);
+	}
+	frame.sounds.clear();
+
+	//Update and draw effects
+	gParticles.emitStress(camera);
+	gParticles.update();
+	gParticles.render(camera.x, camera.y);
+
+	//HUD is drawn at native resolution on top of the world, the label texture only changes with the health
+	dynamicResolution.endWorld(gRenderer);
+	gTextTexture.render(0, 0);
+
+	//Pool usage for telemetry
+	gTelemetry.setGauge("enemies.active", frame.activeEnemies);
+	gTelemetry.setGauge("enemies.pool", WaveSpawner::MAX_ENEMIES);
+	gTelemetry.setGauge("projectiles.count", (long long)frame.projectiles.size());
+	gTelemetry.setGauge("projectiles.capacity", frame.projectileCapacity);
+	gTelemetry.setGauge("particles.live", gParticles.getLiveCount());
+	gTelemetry.setGauge("audio.dropped", gAudio.getDroppedCount());
+	gTelemetry.setGauge("audio.stolen", gAudio.getStolenCount());
+	gTelemetry.setGauge("layers.background.hit_rate", compositor.getHitRate(LAYER_BACKGROUND));
+	gTelemetry.update();
+	gTelemetry.renderOverlay();
+
+	//Copy the frame out for recording before it is presented
+	capture.captureFrame(gRenderer);
+
+	//Update screen
+	SDL_RenderPresent(gRenderer);
+
+	dynamicResolution.framePresented();
 }
 
 bool init()
@@ -643,6 +5556,12 @@ bool init()
 			//Create vsynced renderer for window
 			gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
 			if (gRenderer == NULL)
+			{
+				//No GPU, e.g. headless under the dummy video driver
+				printf("Warning: accelerated renderer unavailable, using software! SDL Error: %s\n", SDL_GetError());
+				gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_SOFTWARE);
+			}
+			if (gRenderer == NULL)
 			{
 				printf("Renderer could not be created! SDL Error: %s\n", SDL_GetError());
 				success = false;
@@ -665,6 +5584,9 @@ bool init()
 					printf("SDL_ttf could not initialize! SDL_ttf Error: %s\n", TTF_GetError());
 					success = false;
 				}
+
+				//Sound is optional, a missing device just leaves the game silent
+				gAudio.init();
 			}
 		}
 	}
@@ -672,50 +5594,143 @@ bool init()
 	return success;
 }
 
-bool loadMedia()
+bool loadAnimations()
 {
 	//Loading success flag
 	bool success = true;
 
-	//Load dot texture
-	if (!gIdleSheetTexture.loadFromFile("Gangsters_1/Idle.png"))
+	//Frame boxes on the sheets, the clips keep their own copies
+	SDL_Rect idleClips[IDLE_ANIMATION_FRAMES];
+	SDL_Rect spriteClips[WALKING_ANIMATION_FRAMES];
+	SDL_Rect enemyClips[ENEMY_ANIMATION_FRAMES];
+
+	idleClips[0].x = 44;
+	idleClips[0].y = 0;
+	idleClips[0].w = 100;
+	idleClips[0].h = 155;
+
+	idleClips[1].x = 171;
+	idleClips[1].y = 0;
+	idleClips[1].w = 100;
+	idleClips[1].h = 155;
+
+	idleClips[2].x = 298;
+	idleClips[2].y = 0;
+	idleClips[2].w = 100;
+	idleClips[2].h = 155;
+
+	idleClips[3].x = 425;
+	idleClips[3].y = 0;
+	idleClips[3].w = 100;
+	idleClips[3].h = 155;
+
+	idleClips[4].x = 552;
+	idleClips[4].y = 0;
+	idleClips[4].w = 100;
+	idleClips[4].h = 155;
+
+	idleClips[5].x = 679;
+	idleClips[5].y = 0;
+	idleClips[5].w = 100;
+	idleClips[5].h = 155;
+
+	spriteClips[0].x = 38;
+	spriteClips[0].y = 0;
+	spriteClips[0].w = 100;
+	spriteClips[0].h = 155;
+
+	spriteClips[1].x = 168;
+	spriteClips[1].y = 0;
+	spriteClips[1].w = 100;
+	spriteClips[1].h = 155;
+
+	spriteClips[2].x = 290;
+	spriteClips[2].y = 0;
+	spriteClips[2].w = 100;
+	spriteClips[2].h = 155;
+
+	spriteClips[3].x = 410;
+	spriteClips[3].y = 0;
+	spriteClips[3].w = 100;
+	spriteClips[3].h = 155;
+
+	spriteClips[4].x = 545;
+	spriteClips[4].y = 0;
+	spriteClips[4].w = 100;
+	spriteClips[4].h = 155;
+
+	spriteClips[5].x = 665;
+	spriteClips[5].y = 0;
+	spriteClips[5].w = 100;
+	spriteClips[5].h = 155;
+
+	enemyClips[0].x = 38;
+	enemyClips[0].y = 0;
+	enemyClips[0].w = 100;
+	enemyClips[0].h = 155;
+
+	enemyClips[1].x = 168;
+	enemyClips[1].y = 0;
+	enemyClips[1].w = 100;
+	enemyClips[1].h = 155;
+
+	enemyClips[2].x = 290;
+	enemyClips[2].y = 0;
+	enemyClips[2].w = 100;
+	enemyClips[2].h = 155;
+
+	enemyClips[3].x = 410;
+	enemyClips[3].y = 0;
+	enemyClips[3].w = 100;
+	enemyClips[3].h = 155;
+
+	enemyClips[4].x = 545;
+	enemyClips[4].y = 0;
+	enemyClips[4].w = 100;
+	enemyClips[4].h = 155;
+
+	enemyClips[5].x = 665;
+	enemyClips[5].y = 0;
+	enemyClips[5].w = 100;
+	enemyClips[5].h = 155;
+
+	//Clip timelines, only the first six run frames are placed
+	gAnimations.defineClip(CLIP_IDLE, idleClips, IDLE_ANIMATION_FRAMES, true, CLIP_IDLE);
+	gAnimations.defineClip(CLIP_RUN, spriteClips, 6, true, CLIP_RUN);
+	gAnimations.defineGridClip(CLIP_SHOT, 128, false, CLIP_IDLE);
+	gAnimations.defineGridClip(CLIP_HURT, 128, false, CLIP_IDLE);
+	gAnimations.defineGridClip(CLIP_DEAD, 128, false, CLIP_DEAD);
+	gAnimations.defineClip(CLIP_ENEMY_IDLE, enemyClips, ENEMY_ANIMATION_FRAMES, true, CLIP_ENEMY_IDLE);
+	gAnimations.defineGridClip(CLIP_ENEMY_HURT, 128, false, CLIP_ENEMY_IDLE);
+	gAnimations.defineGridClip(CLIP_ENEMY_DEAD, 128, false, CLIP_ENEMY_DEAD);
+
+	//Grid cells and pixel masks come from the images, clips without masks fall back to the hand-placed boxes
+	for (int clip = 0; clip < CLIP_TOTAL; ++clip)
 	{
-		printf("Failed to load dot texture!\n");
-		success = false;
+		if (!gAnimations.loadSheet((AnimClip)clip, gClipSheets[clip]))
+		{
+			success = false;
+		}
 	}
-	else
-	{
-		gIdleClips[0].x = 44;
-		gIdleClips[0].y = 0;
-		gIdleClips[0].w = 100;
-		gIdleClips[0].h = 155;
-
-		gIdleClips[1].x = 171;
-		gIdleClips[1].y = 0;
-		gIdleClips[1].w = 100;
-		gIdleClips[1].h = 155;
-
-		gIdleClips[2].x = 298;
-		gIdleClips[2].y = 0;
-		gIdleClips[2].w = 100;
-		gIdleClips[2].h = 155;
+	gAnimations.shareBounds(CLIP_IDLE, CLIP_DEAD);
+	gAnimations.shareBounds(CLIP_ENEMY_IDLE, CLIP_ENEMY_DEAD);
 
-		gIdleClips[3].x = 425;
-		gIdleClips[3].y = 0;
-		gIdleClips[3].w = 100;
-		gIdleClips[3].h = 155;
-
-		gIdleClips[4].x = 552;
-		gIdleClips[4].y = 0;
-		gIdleClips[4].w = 100;
-		gIdleClips[4].h = 155;
+	return success;
+}
 
-		gIdleClips[5].x = 679;
-		gIdleClips[5].y = 0;
-		gIdleClips[5].w = 100;
-		gIdleClips[5].h = 155;
+bool loadMedia()
+{
+	//Loading success flag
+	bool success = true;
 
+	//Particle arrays and their vertex batch
+	gParticles.init();
 
+	//Load dot texture
+	if (!gIdleSheetTexture.loadFromFile("Gangsters_1/Idle.png"))
+	{
+		printf("Failed to load dot texture!\n");
+		success = false;
 	}
 
 	if (!gWalkingSheetTexture.loadFromFile("Gangsters_1/Run.png"))
@@ -723,46 +5738,18 @@ bool loadMedia()
 		printf("Failed to load walking texture");
 		success = false;
 	}
-	else
-	{
-		gSpriteClips[0].x = 38;
-		gSpriteClips[0].y = 0;
-		gSpriteClips[0].w = 100;
-		gSpriteClips[0].h = 155;
-
-		gSpriteClips[1].x = 168;
-		gSpriteClips[1].y = 0;
-		gSpriteClips[1].w = 100;
-		gSpriteClips[1].h = 155;
-
-		gSpriteClips[2].x = 290;
-		gSpriteClips[2].y = 0;
-		gSpriteClips[2].w = 100;
-		gSpriteClips[2].h = 155;
-
-		gSpriteClips[3].x = 410;
-		gSpriteClips[3].y = 0;
-		gSpriteClips[3].w = 100;
-		gSpriteClips[3].h = 155;
-
-		gSpriteClips[4].x = 545;
-		gSpriteClips[4].y = 0;
-		gSpriteClips[4].w = 100;
-		gSpriteClips[4].h = 155;
-
-		gSpriteClips[5].x = 665;
-		gSpriteClips[5].y = 0;
-		gSpriteClips[5].w = 100;
-		gSpriteClips[5].h = 155;
-	}
-
 
 	//Load background texture
-	if (!gBGTexture.loadFromFile("City3/Bright/City3.png"))
+	gBGTexture = gThemes.get("City3/Bright/City3.png", gTheme);
+	if (gBGTexture == NULL)
 	{
 		printf("Failed to load background texture!\n");
 		success = false;
 	}
+	else
+	{
+		gThemes.printReport();
+	}
 	//font
 	gFont = TTF_OpenFont("lazy.ttf", 28);
 	if (gFont == NULL)
@@ -785,39 +5772,45 @@ bool loadMedia()
 		printf("Failed to load enemy texture!\n");
 		success = false;
 	}
-	else
-	{
-
-		gEnemyclips[0].x = 38;
-		gEnemyclips[0].y = 0;
-		gEnemyclips[0].w = 100;
-		gEnemyclips[0].h = 155;
-
-		gEnemyclips[1].x = 168;
-		gEnemyclips[1].y = 0;
-		gEnemyclips[1].w = 100;
-		gEnemyclips[1].h = 155;
 
-		gEnemyclips[2].x = 290;
-		gEnemyclips[2].y = 0;
-		gEnemyclips[2].w = 100;
-		gEnemyclips[2].h = 155;
-
-		gEnemyclips[3].x = 410;
-		gEnemyclips[3].y = 0;
-		gEnemyclips[3].w = 100;
-		gEnemyclips[3].h = 155;
-
-		gEnemyclips[4].x = 545;
-		gEnemyclips[4].y = 0;
-		gEnemyclips[4].w = 100;
-		gEnemyclips[4].h = 155;
+	//One-off animations, frames are 128 pixel cells across the sheet
+	if (!gShotSheetTexture.loadFromFile("Gangsters_1/Shot.png"))
+	{
+		printf("Failed to load shot texture!\n");
+		success = false;
+	}
+	if (!gHurtSheetTexture.loadFromFile("Gangsters_1/Hurt.png"))
+	{
+		printf("Failed to load hurt texture!\n");
+		success = false;
+	}
+	if (!gDeadSheetTexture.loadFromFile("Gangsters_1/Dead.png"))
+	{
+		printf("Failed to load dead texture!\n");
+		success = false;
+	}
+	if (!gEnemyHurtTexture.loadFromFile("Gangsters_2/Hurt.png"))
+	{
+		printf("Failed to load enemy hurt texture!\n");
+		success = false;
+	}
+	if (!gEnemyDeadTexture.loadFromFile("Gangsters_2/Dead.png"))
+	{
+		printf("Failed to load enemy dead texture!\n");
+		success = false;
+	}
 
-		gEnemyclips[5].x = 665;
-		gEnemyclips[5].y = 0;
-		gEnemyclips[5].w = 100;
-		gEnemyclips[5].h = 155;
+	//Clips are shared with headless runs, only what draws them is set here
+	if (!loadAnimations())
+	{
+		printf("Failed to load animations!\n");
+		success = false;
+	}
+	for (int clip = 0; clip < CLIP_TOTAL; ++clip)
+	{
+		gAnimations.setSheet((AnimClip)clip, gClipTextures[clip]);
 	}
+
 	return success;
 }
 
@@ -825,11 +5818,23 @@ void close()
 {
 	//Free loaded images
 	gDotTexture.free();
-	gBGTexture.free();
+	for (int i = 0; i < CLIP_TOTAL; ++i)
+	{
+		gClipTextures[i]->free();
+	}
+	gTextTexture.free();
+	gThemes.free();
+	gBGTexture = NULL;
+	gHealthLabels.free();
 
 	TTF_CloseFont(gFont);
 	gFont = NULL;
 
+	//Overlay textures go before the renderer, and the last dump is written
+	gTelemetry.free();
+
+	//Stop audio before the rest of SDL goes away
+	gAudio.close();
 
 	//Destroy window	
 	SDL_DestroyRenderer(gRenderer);
@@ -845,8 +5850,91 @@ void close()
 }
 //check if this code is being used
 
+//Runs headless simulations instead of the game, nothing is drawn or played so no window, audio or texture is made
+int runBatch(int argc, char* args[])
+{
+	int instances = 0;
+	int frames = 3600;
+	int stressEnemies = 0;
+	int levelWidth = LEVEL_WIDTH;
+
+	//Game options are skipped over
+	for (int i = 1; i < argc; ++i)
+	{
+		std::string option = args[i];
+		if (option == "--pipeline" || i + 1 >= argc)
+		{
+			continue;
+		}
+
+		if (option == "--batch")
+		{
+			instances = atoi(args[++i]);
+		}
+		else if (option == "--frames")
+		{
+			frames = atoi(args[++i]);
+		}
+		else if (option == "--stress")
+		{
+			stressEnemies = atoi(args[++i]);
+		}
+		else if (option == "--level")
+		{
+			levelWidth = ChunkedLevel::readWidth(args[++i]);
+		}
+		else
+		{
+			++i;
+		}
+	}
+
+	//Only image decoding is needed, for the clip sheets
+	if (SDL_Init(0) < 0)
+	{
+		printf("SDL could not initialize! SDL Error: %s\n", SDL_GetError());
+		return 1;
+	}
+	int imgFlags = IMG_INIT_PNG;
+	if (!(IMG_Init(imgFlags) & imgFlags))
+	{
+		printf("SDL_image could not initialize! SDL_image Error: %s\n", IMG_GetError());
+		SDL_Quit();
+		return 1;
+	}
+
+	if (!loadAnimations())
+	{
+		printf("Failed to load animations, running with the hand-placed boxes!\n");
+	}
+
+	if (instances > 0)
+	{
+		BatchRunner batch;
+		batch.run(instances, frames, stressEnemies, levelWidth);
+		batch.printStats();
+	}
+
+	IMG_Quit();
+	SDL_Quit();
+	return 0;
+}
+
 int main(int argc, char* args[])
 {
+#ifdef _DEBUG
+	checkSweepCollision();
+#endif
+
+	//A batch run replaces the game
+	for (int i = 1; i < argc; ++i)
+	{
+		if (std::string(args[i]) == "--batch")
+		{
+			return runBatch(argc, args);
+		}
+	}
+
 	//Start up SDL and create window
 	if (!init())
 	{
@@ -867,143 +5955,170 @@ int main(int argc, char* args[])
 			//Event handler
 			SDL_Event e;
 
-			//Current animation frame
-			int frame = 0;
-			//The dot that will be moving around on the screen
-			Dot dot;
-
-			Enemy Enemy(900, 800);
+			//The game world
+			Simulation simulation;
 
-			//The camera area
-			SDL_Rect camera = { 50, 50, SCREEN_WIDTH, SCREEN_HEIGHT };
+			//Simulation thread, when running frames come from it instead
+			SimulationPipeline pipeline;
+			bool pipelined = false;
 
-			//While application is running
-			while (!quit)
-			{
-				//Handle events on queue
-				while (SDL_PollEvent(&e) != 0)
-				{
-					//User requests quit
-					if (e.type == SDL_QUIT)
-					{
-						quit = true;
-					}
+			//What gets drawn when the simulation is stepped on this thread
+			RenderFrame localFrame;
 
-					//Handle input for the dot
-					dot.handleEvent(e);
+			//Input for the frame when the simulation is stepped on this thread
+			std::vector<SDL_Event> frameEvents;
 
-				}
+			//Tile level streamed around the camera, the plain background is used without one
+			ChunkedLevel level;
 
-				//Move the dot
+			//Gameplay recording
+			FrameCapture capture;
 
-			
-				
-					dot.move(Enemy.getCollider());
-				
-				
-					Enemy.move();
-				
+			//Offscreen world rendering that trades resolution for frame time
+			DynamicResolution dynamicResolution;
 
-				//Center the camera over the dot
-				camera.x = (dot.getPosX() + Dot::DOT_WIDTH / 2) - SCREEN_WIDTH / 2;
-				camera.y = (dot.getPosY() + Dot::DOT_HEIGHT / 2) - SCREEN_HEIGHT / 2;
+			//Cached level background, drawn directly when targets aren't available
+			LayerCompositor compositor;
+			if (!compositor.init(gRenderer, SCREEN_WIDTH, SCREEN_HEIGHT))
+			{
+				printf("Layer cache unavailable, redrawing every layer each frame!\n");
+			}
 
-				//Keep the camera in bounds
-				if (camera.x < 0)
+			//Command line options, most take a value
+			for (int i = 1; i < argc; ++i)
+			{
+				std::string option = args[i];
+				if (option == "--pipeline")
+				{
+					pipelined = true;
+				}
+				else if (i + 1 >= argc)
 				{
-					camera.x = 0;
+					printf("Option %s needs a value!\n", option.c_str());
 				}
-				if (camera.y < 0)
+				else if (option == "--stress")
 				{
-					camera.y = 0;
+					simulation.getWaves().setStressSchedule(atoi(args[++i]));
 				}
-				if (camera.x > LEVEL_WIDTH - camera.w)
+				else if (option == "--capture")
 				{
-					camera.x = LEVEL_WIDTH - camera.w;
+					if (!capture.start(args[++i], gRenderer))
+					{
+						printf("Failed to start capture!\n");
+					}
 				}
-				if (camera.y > LEVEL_HEIGHT - camera.h)
+				else if (option == "--dynres")
 				{
-					camera.y = LEVEL_HEIGHT - camera.h;
+					double budget = atof(args[++i]);
+					if (budget <= 0.0 || !dynamicResolution.init(gRenderer, SCREEN_WIDTH, SCREEN_HEIGHT, budget))
+					{
+						printf("Failed to start dynamic resolution, give a frame budget in ms!\n");
+					}
 				}
+				else if (option == "--particles")
+				{
+					gParticles.setStressTarget(atoi(args[++i]));
+				}
+				else if (option == "--telemetry")
+				{
+					gTelemetry.openDump(args[++i]);
+				}
+				else if (option == "--level")
+				{
+					if (!level.open(args[++i]))
+					{
+						printf("Failed to open level, using the default background!\n");
+					}
+				}
+			}
 
-				//Clear screen
-				SDL_SetRenderDrawColor(gRenderer, 0xFF, 0xFF, 0xFF, 0xFF);
-				SDL_RenderClear(gRenderer);
-
-				//Render background
-				gBGTexture.render(0, 0, &camera);
-
-				//Render objects
-				dot.render(camera.x, camera.y);
-
-				gTextTexture.render(0, 0);
+			simulation.setLevelWidth(level.getWidth());
 
-				Enemy.render(camera.x, camera.y);
+			//Simulate one frame ahead on another core
+			if (pipelined && !pipeline.start(&simulation))
+			{
+				printf("Failed to start the simulation thread, running on one thread!\n");
+			}
 
-				for (size_t i = 0; i < projectiles.size();)
+			//While application is running
+			while (!quit)
+			{
+				//Handle events on queue
+				frameEvents.clear();
+				while (SDL_PollEvent(&e) != 0)
 				{
-					projectiles[i].move();
-					projectiles[i].render(camera.x,camera.y);
-
-					if (projectiles[i].isOffScreen())
+					//User requests quit
+					if (e.type == SDL_QUIT)
 					{
-						projectiles.erase(projectiles.begin() + i);
+						quit = true;
 					}
-					else
+
+					//Switch the level art theme
+					if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_t)
 					{
-						++i;
+						gTheme = (Theme)((gTheme + 1) % THEME_TOTAL);
+						LTexture* background = gThemes.get("City3/Bright/City3.png", gTheme);
+						if (background != NULL)
+						{
+							gBGTexture = background;
+							level.reloadTileset();
+							gThemes.trim();
+							gThemes.printReport();
+						}
 					}
-				}
-
-				// Update projectiles
-				for (auto it = projectiles.begin(); it != projectiles.end(); ) {
-					it->move();
 
-					// If the projectile collides with the enemy
-					if (Enemy.isDead())
+					//Show memory and pool usage
+					if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_F1)
 					{
-						gEnemyTexture.free();
-						
-						
+						gTelemetry.toggleOverlay();
 					}
-					if (!Enemy.isDead() && checkCollision(it->getCollider(), Enemy.getCollider())) {
-						Enemy.takeDamage(10);
-						it = projectiles.erase(it); // Remove projectile after hit
+
+					//Print level streaming stats
+					if (e.type == SDL_KEYDOWN && e.key.repeat == 0 && e.key.keysym.sym == SDLK_l && level.isOpen())
+					{
+						level.printStats();
 					}
-					else if (it->isOffScreen()) {
-						it = projectiles.erase(it); // Remove projectile if off-screen
+
+					//Cached layers don't survive the renderer losing its targets
+					if (e.type == SDL_RENDER_TARGETS_RESET)
+					{
+						compositor.invalidateAll();
 					}
-					else {
-						++it;
+
+					//Keys the simulation acts on are passed on, the rest stop here
+					if (Simulation::isInput(e))
+					{
+						if (pipeline.isRunning())
+						{
+							pipeline.postEvent(e);
+						}
+						else
+						{
+							frameEvents.push_back(e);
+						}
 					}
 				}
-				for (auto& proj : projectiles)
+
+				//Draw frame N while the simulation thread works on N+1
+				if (pipeline.isRunning())
 				{
-					proj.render(camera.x, camera.y);
+					RenderFrame* frame = pipeline.acquireFrame();
+					gTelemetry.setGauge("pipeline.render_stalls", pipeline.getRenderStalls());
+					gTelemetry.setGauge("pipeline.sim_stalls", pipeline.getSimulationStalls());
+					renderFrame(*frame, level, compositor, dynamicResolution, capture);
+					pipeline.releaseFrame(frame);
 				}
-
-				//Update screen
-				SDL_RenderPresent(gRenderer);
-
-				//health
-				SDL_Color textColor = { 255, 255, 255 };  // White color
-				std::string healthText = "Health: " + std::to_string(dot.getHealth());
-
-				//SDL_Color EtextColor = { 255, 255, 255 };
-				//std::string EhealthText = "Enemy health: " + std::to_string(Enemy.health());
-
-				gTextTexture.loadFromRenderedText(healthText, textColor);
-				gTextTexture.render(10, 10);  // Render at top left corner
-
-
-				//Go to next frame
-				++frame;
-
-				//Cycle animation
-				if (frame / 6 >= (dot.mState == Dot::WALKING ? WALKING_ANIMATION_FRAMES : IDLE_ANIMATION_FRAMES)) {
-					frame = 0;
+				else
+				{
+					simulation.step(frameEvents.data(), (int)frameEvents.size());
+					simulation.copyFrame(localFrame);
+					renderFrame(localFrame, level, compositor, dynamicResolution, capture);
 				}
 			}
+
+			//Stop simulating before anything it uses goes away
+			pipeline.stop();
+			compositor.printStats();
 		}
 	}
 	//Free resources and close SDL